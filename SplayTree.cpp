@@ -3,103 +3,543 @@
 #include <iostream>
 #include <vector>
 #include <functional>
+#include <memory>
+#include <deque>
+#include <stdexcept>
+#include <numeric>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <iterator>
+#include <cstdio>
+#include <csignal>
+#include <cerrno>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+class SplayForest;
 
 class SplayTree {
 public:
-    SplayTree() = default;
+    SplayTree() : ownPool_(new NodePool()), pool_(ownPool_.get()) {}
 
-    explicit SplayTree(const std::vector<long long> &v) {
-        for (int i = 0; i < v.size(); i++) {
-            tree_ = insert_(tree_, i + 1, v[i]);
-        }
+    explicit SplayTree(const std::vector<long long> &v) : SplayTree() {
+        setRoot_(build_(v.data(), v.size()));
     }
 
-    SplayTree(size_t size, long long initialValue) {
-        for (int i = 0; i < size; i++) {
-            tree_ = insert_(tree_, i + 1, initialValue);
-        }
+    SplayTree(size_t size, long long initialValue) : SplayTree() {
+        std::vector<long long> values(size, initialValue);
+        setRoot_(build_(values.data(), values.size()));
+    }
+
+    SplayTree(const SplayTree &other) : SplayTree() {
+        tree_ = clone_(other.tree_, *other.pool_);
+        pool_->lastQueryTime = other.pool_->lastQueryTime;
     }
 
-    SplayTree(const SplayTree &other) {
-        tree_ = other.tree_ == nullptr ? new Node(*other.tree_) : nullptr;
-        lastQueryTime_ = other.lastQueryTime_;
+    // A moved-from tree is left empty, keeping a pool of its own (or its slot in a SplayForest).
+    SplayTree(SplayTree &&other) : SplayTree() {
+        *this = std::move(other);
     }
 
+    // The nodes stay in the pool of this tree, which matters for sequences of a SplayForest.
     SplayTree &operator=(const SplayTree &other) {
-        // copy-and-swap idiom
         if (this == &other) {
             return *this;
         }
-        SplayTree tmp(other);
-        std::swap(tree_, tmp.tree_);
-        std::swap(lastQueryTime_, tmp.lastQueryTime_);
+        pool_->release(tree_);
+        tree_ = NIL;
+        tree_ = clone_(other.tree_, *other.pool_);
+        pool_->lastQueryTime = std::max(pool_->lastQueryTime, other.pool_->lastQueryTime);
+        return *this;
+    }
+
+    // Pools are swapped only when both trees own theirs; the nodes never leave a SplayForest
+    // or a mapped file of this tree, so they are copied instead.
+    SplayTree &operator=(SplayTree &&other) {
+        if (this == &other) {
+            return *this;
+        }
+        if (pool_ == other.pool_) {
+            pool_->release(tree_);
+            tree_ = other.tree_;
+        } else if (ownPool_ != nullptr && other.ownPool_ != nullptr && !pool_->isMapped()) {
+            std::swap(ownPool_, other.ownPool_);
+            std::swap(pool_, other.pool_);
+            std::swap(tree_, other.tree_);
+            other.pool_->release(other.tree_);
+        } else {
+            *this = other;
+            other.pool_->release(other.tree_);
+        }
+        other.tree_ = NIL;
         return *this;
     }
 
     ~SplayTree() {
-        delete tree_;
+        if (pool_->isMapped()) {
+            pool_->closeFile(tree_);
+        } else {
+            pool_->release(tree_);
+        }
     }
 
-    long long operator[](int i) {
-        return elementAt_(tree_, i + 1);
+    long long operator[](long long i) {
+        return elementAt_(root_(), i + 1);
     }
 
-    long long getSum(int l, int r) {
-        auto res = getSum_(tree_, l + 1, r + 1);
-        tree_ = res.second;
+    long long getSum(long long l, long long r) {
+        auto res = getSum_(root_(), l + 1, r + 1);
+        setRoot_(res.second);
         return res.first;
     }
 
-    void insert(int i, int x) {
-        tree_ = insert_(tree_, i + 1, x);
+    void insert(long long i, long long x) {
+        setRoot_(insert_(root_(), i + 1, x));
+    }
+
+    void remove(long long i) {
+        setRoot_(remove_(root_(), i + 1));
     }
 
-    void remove(int i) {
-        tree_ = remove_(tree_, i + 1);
+    void assign(long long l, long long r, long long x) {
+        setRoot_(assign_(root_(), l + 1, r + 1, x, pool_->lastQueryTime));
     }
 
-    void assign(int l, int r, int x) {
-        tree_ = assign_(tree_, l + 1, r + 1, x, lastQueryTime_);
+    void add(long long l, long long r, long long x) {
+        setRoot_(add_(root_(), l + 1, r + 1, x, pool_->lastQueryTime));
     }
 
-    void add(int l, int r, int x) {
-        tree_ = add_(tree_, l + 1, r + 1, x, lastQueryTime_);
+    void nextPermutation(long long l, long long r) {
+        setRoot_(nextPermutation_(root_(), l + 1, r + 1));
     }
 
-    void nextPermutation(int l, int r) {
-        tree_ = nextPermutation_(tree_, l + 1, r + 1);
+    void prevPermutation(long long l, long long r) {
+        setRoot_(prevPermutation_(root_(), l + 1, r + 1));
     }
 
-    void prevPermutation(int l, int r) {
-        tree_ = prevPermutation_(tree_, l + 1, r + 1);
+    void reverse(long long l, long long r) {
+        setRoot_(reverse_(root_(), l + 1, r + 1));
+    }
+
+    // Ranges must not overlap; they may be given in any order.
+    void swapRanges(long long l1, long long r1, long long l2, long long r2) {
+        if (l1 > l2) {
+            std::swap(l1, l2);
+            std::swap(r1, r2);
+        }
+        setRoot_(swapSegments_(root_(), l1 + 1, r1 + 1, l2 + 1, r2 + 1));
+    }
+
+    // Cuts [l, r] out and inserts it back so that it starts at position dst
+    // of the resulting sequence.
+    void moveRange(long long l, long long r, long long dst) {
+        setRoot_(moveSegment_(root_(), l + 1, r + 1, dst + 1));
+    }
+
+    // Rotates [l, r] to the left so that the element at m becomes the first one (like std::rotate).
+    void rotate(long long l, long long m, long long r) {
+        if (l == m) {
+            return;
+        }
+        setRoot_(swapSegments_(root_(), l + 1, m, m + 1, r + 1));
+    }
+
+    void sortRange(long long l, long long r, bool ascending = true) {
+        setRoot_(sort_(root_(), l + 1, r + 1, ascending));
+    }
+
+    // lowerBound and upperBound expect [l, r] to be sorted in non-decreasing order (e.g. by sortRange)
+    // and return the index of the first element in [l, r] which is not less (greater) than x, or r + 1.
+    long long lowerBound(long long l, long long r, long long x) {
+        auto res = bound_(root_(), l + 1, r + 1, x, std::less<>());
+        setRoot_(res.second);
+        return l + res.first;
+    }
+
+    long long upperBound(long long l, long long r, long long x) {
+        auto res = bound_(root_(), l + 1, r + 1, x, std::less_equal<>());
+        setRoot_(res.second);
+        return l + res.first;
     }
 
     size_t size() const {
-        return getSize_(tree_);
+        return getSize_(root_());
+    }
+
+#ifdef SPLAY_TREE_HASH
+    // Polynomial hash of [l, r]. Equal ranges (of this or any other tree) have equal hashes.
+    uint64_t rangeHash(long long l, long long r) {
+        Hash hash = rangeHash_(l, r);
+        return hash.modular ^ hash.wide;
+    }
+
+    // Compares both hash components: different ranges of length k are reported equal with probability
+    // about k / 2^61 for non-adversarial data, and ranges differing in a single element never are.
+    bool rangesEqual(long long l1, long long r1, long long l2, long long r2) {
+        return r1 - l1 == r2 - l2 && rangeHash_(l1, r1) == rangeHash_(l2, r2);
     }
+#endif
 
     std::vector<long long> toVector() {
         std::vector<long long> result;
-        traverse_(tree_, [&result](Node *node) {
+        traverse_(root_(), [&result](Node *node) {
             result.push_back(node->value);
         });
         return result;
     }
 
+    // Writes a binary snapshot: the in-order values, or with withShape the nodes themselves
+    // in preorder, including aggregates and pending lazy tags, so that nothing is pushed while saving.
+    // journalGeneration is kept for the journal replayed on top of the snapshot (see Journal).
+    bool save(const std::string &path, bool withShape = false, uint64_t journalGeneration = 0) {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            return false;
+        }
+
+        SnapshotHeader header;
+        header.flags = withShape ? SNAPSHOT_WITH_SHAPE | SNAPSHOT_SHAPE_FLAGS : 0;
+        header.count = size();
+        header.lastQueryTime = pool_->lastQueryTime;
+        header.journalGeneration = journalGeneration;
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        if (withShape) {
+            writeNodeRecords_(root_(), out);
+        } else {
+            std::vector<long long> buffer;
+            buffer.reserve(SNAPSHOT_BUFFER_SIZE);
+            traverse_(root_(), [&buffer, &out](Node *node) {
+                buffer.push_back(node->value);
+                if (buffer.size() == SNAPSHOT_BUFFER_SIZE) {
+                    out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * sizeof(long long));
+                    buffer.clear();
+                }
+            });
+            out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * sizeof(long long));
+        }
+        return static_cast<bool>(out.flush());
+    }
+
+    // Replaces the tree with a snapshot written by save. The file is memory-mapped
+    // and the tree is built in linear time. Returns false (leaving the tree untouched) on failure.
+    bool load(const std::string &path, uint64_t *journalGeneration = nullptr) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat fileStat{};
+        if (fstat(fd, &fileStat) != 0 || static_cast<size_t>(fileStat.st_size) < sizeof(SnapshotHeader)) {
+            close(fd);
+            return false;
+        }
+        size_t fileSize = fileStat.st_size;
+        void *data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            return false;
+        }
+        madvise(data, fileSize, MADV_SEQUENTIAL);
+
+        SnapshotHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        const char *payload = static_cast<const char *>(data) + sizeof(header);
+        bool withShape = header.flags & SNAPSHOT_WITH_SHAPE;
+        size_t recordSize = withShape ? sizeof(NodeRecord) : sizeof(long long);
+
+        bool valid = std::memcmp(header.magic, SnapshotHeader().magic, sizeof(header.magic)) == 0 &&
+                     header.version == SNAPSHOT_VERSION &&
+                     (!withShape || header.flags == (SNAPSHOT_WITH_SHAPE | SNAPSHOT_SHAPE_FLAGS)) &&
+                     header.count <= (fileSize - sizeof(header)) / recordSize &&
+                     header.count * recordSize == fileSize - sizeof(header);
+        NodeId root = NIL;
+        if (valid && withShape) {
+            valid = readNodeRecords_(reinterpret_cast<const NodeRecord *>(payload), header.count, root);
+        } else if (valid) {
+            root = id_(build_(reinterpret_cast<const long long *>(payload), header.count));
+        }
+        if (valid) {
+            pool_->release(tree_);
+            tree_ = root;
+            pool_->lastQueryTime = std::max(pool_->lastQueryTime, header.lastQueryTime);
+            if (journalGeneration != nullptr) {
+                *journalGeneration = header.journalGeneration;
+            }
+        }
+
+        munmap(data, fileSize);
+        return valid;
+    }
+
+    // Out-of-core mode: keeps the nodes in the file at path, mapped into memory, so that the tree
+    // may outgrow RAM. A file left by a mapped tree is reopened as that tree, without a rebuild,
+    // replacing the current contents; a missing or empty file is created holding the current contents.
+    // The file is written back when the tree is destroyed; one that was not (after a crash) is refused.
+    // Sequences of a SplayForest cannot be mapped.
+    bool mapFile(const std::string &path) {
+        if (ownPool_ == nullptr) {
+            return false;
+        }
+        std::unique_ptr<NodePool> pool(new NodePool());
+        bool created = false;
+        if (!pool->openFile(path, created)) {
+            return false;
+        }
+        if (created) {
+            try {
+                pool->copyNodes(*ownPool_);
+            } catch (const std::bad_alloc &) {
+                // the file is new, so nothing but the failed copy is lost
+                pool.reset();
+                unlink(path.c_str());
+                return false;
+            }
+        }
+        if (ownPool_->isMapped()) {
+            ownPool_->closeFile(tree_);
+        }
+        if (!created) {
+            tree_ = pool->fileHeader->root;
+        }
+        ownPool_ = std::move(pool);
+        pool_ = ownPool_.get();
+        return true;
+    }
+
+    // Bytes taken by the tree: the pool it owns, or just its nodes if it shares the pool of a SplayForest.
+    size_t memoryUsage() const {
+        if (ownPool_ != nullptr) {
+            return sizeof(*this) + ownPool_->memoryUsage();
+        }
+        return sizeof(*this) + size() * sizeof(Node);
+    }
+
 private:
+    friend class SplayForest;
+
+    // Nodes are addressed by their index in the node array of the pool, NIL meaning no node.
+    using NodeId = uint32_t;
+    static constexpr NodeId NIL = 0;
+
     struct Node;
-    SplayTree::Node *tree_ = nullptr;
+    struct NodePool;
+
+    std::unique_ptr<NodePool> ownPool_;
+    NodePool *pool_;
+    NodeId tree_ = NIL;
 
     struct Query;
-    int lastQueryTime_ = 0;
 
-    enum Monotone {
+public:
+    // A sequence of a SplayForest, constructed in place by the forest, which alone can name its pool.
+    explicit SplayTree(NodePool &pool) : pool_(&pool) {}
+
+private:
+
+#ifdef SPLAY_TREE_HASH
+    static constexpr uint64_t HASH_MOD = (1ULL << 61) - 1;
+    // fixed, so that hashes of different trees can be compared
+    static constexpr uint64_t HASH_BASE = 0x1d8af1c2b3e4f5a7ULL % HASH_MOD;
+    static constexpr uint64_t WIDE_HASH_BASE = 0x9e3779b97f4a7c15ULL;
+
+    // A polynomial hash in two components: modulo 2^61 - 1, and modulo 2^64 with an odd base.
+    // A residue modulo 2^61 - 1 alone cannot tell a 64-bit value v from v + 2^61 - 1; the pair of them
+    // tells all values apart, and stays additive, which the lazy add relies on.
+    struct Hash {
+        uint64_t modular;
+        uint64_t wide;
+
+        bool operator==(const Hash &h) const {
+            return modular == h.modular && wide == h.wide;
+        }
+    };
+
+    // power(k) = HASH_BASE^k, powerSum(k) = HASH_BASE^0 + ... + HASH_BASE^(k - 1) (in both components),
+    // kept once for the process for each k up to the largest number of nodes a pool has had.
+    // The table grows under a mutex by whole blocks, which never move and are never freed,
+    // so that trees used from different threads read it without locking.
+    struct HashPowers {
+        struct Entry {
+            Hash power;
+            Hash powerSum;
+        };
+
+        static constexpr size_t BLOCK_BITS = 16;
+        static constexpr size_t BLOCK_SIZE = size_t(1) << BLOCK_BITS;
+        // enough for k up to the largest node index plus one
+        static constexpr size_t MAX_BLOCKS = ((size_t(UINT32_MAX) + 1) >> BLOCK_BITS) + 1;
+
+        static std::atomic<Entry *> blocks[MAX_BLOCKS];
+        // entries filled so far, a multiple of BLOCK_SIZE
+        static std::atomic<size_t> count;
+        static std::mutex growMutex;
+
+        // Makes power(k) and powerSum(k) available for every k <= maxK.
+        static void reserve(size_t maxK) {
+            if (count.load(std::memory_order_acquire) > maxK) {
+                return;
+            }
+            std::lock_guard<std::mutex> lock(growMutex);
+            size_t filled = count.load(std::memory_order_relaxed);
+            while (filled <= maxK) {
+                Entry *block = new Entry[BLOCK_SIZE];
+                const Entry *previous = filled == 0 ? nullptr : &entry(filled - 1);
+                for (size_t i = 0; i < BLOCK_SIZE; i++) {
+                    block[i] = previous == nullptr ? Entry{{1, 1}, {0, 0}} :
+                               Entry{multiplyHash_(previous->power, {HASH_BASE, WIDE_HASH_BASE}),
+                                     addHash_(previous->powerSum, previous->power)};
+                    previous = block + i;
+                }
+                blocks[filled >> BLOCK_BITS].store(block, std::memory_order_release);
+                filled += BLOCK_SIZE;
+            }
+            count.store(filled, std::memory_order_release);
+        }
+
+        static const Entry &entry(size_t k) {
+            return blocks[k >> BLOCK_BITS].load(std::memory_order_acquire)[k & (BLOCK_SIZE - 1)];
+        }
+
+        static Hash power(size_t k) {
+            return entry(k).power;
+        }
+
+        static Hash powerSum(size_t k) {
+            return entry(k).powerSum;
+        }
+    };
+
+    static Hash addHash_(Hash a, Hash b) {
+        uint64_t sum = a.modular + b.modular;
+        return {sum >= HASH_MOD ? sum - HASH_MOD : sum, a.wide + b.wide};
+    }
+
+    static Hash multiplyHash_(Hash a, Hash b) {
+        __uint128_t product = static_cast<__uint128_t>(a.modular) * b.modular;
+        uint64_t result = static_cast<uint64_t>(product & HASH_MOD) + static_cast<uint64_t>(product >> 61);
+        result = (result & HASH_MOD) + (result >> 61);
+        return {result >= HASH_MOD ? result - HASH_MOD : result, a.wide * b.wide};
+    }
+
+    static Hash toHash_(long long value) {
+        long long remainder = value % static_cast<long long>(HASH_MOD);
+        return {static_cast<uint64_t>(remainder < 0 ? remainder + static_cast<long long>(HASH_MOD) : remainder),
+                static_cast<uint64_t>(value)};
+    }
+
+    // hash of count copies of value
+    static Hash repeatedHash_(long long value, long long count) {
+        return multiplyHash_(toHash_(value), HashPowers::powerSum(count));
+    }
+
+    static Hash getHash_(Node *node) {
+        return node == nullptr ? Hash{0, 0} : node->hash;
+    }
+
+    static Hash getReverseHash_(Node *node) {
+        return node == nullptr ? Hash{0, 0} : node->reverseHash;
+    }
+
+    Hash rangeHash_(long long l, long long r) {
+        Hash hash{};
+        setRoot_(makeOperationOnSubSegment_(root_(), l + 1, r + 1, [&hash](Node *treeSegment) {
+            hash = getHash_(treeSegment);
+            return treeSegment;
+        }));
+        return hash;
+    }
+#endif
+
+    static const uint32_t SNAPSHOT_VERSION = 3;
+    static const uint32_t SNAPSHOT_WITH_SHAPE = 1;
+    // shape records carry the hashes when they are compiled in (2 marked the single-component hashes)
+    static const uint32_t SNAPSHOT_WITH_HASH = 4;
+#ifdef SPLAY_TREE_HASH
+    static const uint32_t SNAPSHOT_SHAPE_FLAGS = SNAPSHOT_WITH_HASH;
+#else
+    static const uint32_t SNAPSHOT_SHAPE_FLAGS = 0;
+#endif
+    static const size_t SNAPSHOT_BUFFER_SIZE = 1 << 16;
+
+    // All snapshot fields are stored in the native byte order.
+    struct SnapshotHeader {
+        char magic[4] = {'S', 'P', 'L', 'Y'};
+        uint32_t version = SNAPSHOT_VERSION;
+        uint32_t flags = 0;
+        uint32_t padding = 0;
+        long long lastQueryTime = 0;
+        uint64_t count = 0;
+        // the first journal generation whose records the snapshot does not contain (see Journal)
+        uint64_t journalGeneration = 0;
+    };
+
+    struct NodeRecord {
+        long long size;
+        long long value;
+        long long minValue;
+        long long maxValue;
+        long long firstValue;
+        long long lastValue;
+        long long sum;
+        long long addTime;
+        long long addValue;
+        long long assignTime;
+        long long assignValue;
+#ifdef SPLAY_TREE_HASH
+        Hash hash;
+        Hash reverseHash;
+#endif
+        uint8_t monotone;
+        uint8_t hasRev;
+        // bit 0 - has left child, bit 1 - has right child
+        uint8_t children;
+        uint8_t padding[5];
+    };
+
+    static constexpr uint32_t NODE_FILE_VERSION = 1;
+    // the nodes start on a page of their own
+    static constexpr size_t NODE_FILE_HEADER_SIZE = 4096;
+    static constexpr size_t NODE_FILE_MIN_CAPACITY = 1 << 10;
+
+    // Header of the node file of the out-of-core mode, followed by the node array itself.
+    struct NodeFileHeader {
+        char magic[4] = {'S', 'P', 'L', 'N'};
+        uint32_t version = NODE_FILE_VERSION;
+        uint32_t flags = SNAPSHOT_SHAPE_FLAGS;
+        uint32_t nodeSize = sizeof(Node);
+        // cleared while the file is open, so that a file left by a crash is not trusted
+        uint32_t clean = 1;
+        NodeId root = NIL;
+        NodeId freeList = NIL;
+        uint32_t padding = 0;
+        uint64_t nodeCount = 1;
+        long long lastQueryTime = 0;
+    };
+
+    enum Monotone : uint8_t {
         NON_INCREASING, NON_DECREASING, CONSTANT, NONE
     };
 
     struct Query {
         static const Query EMPTY;
-        int time;
+        long long time;
         long long value;
 
         bool operator==(const Query &q) {
@@ -112,14 +552,12 @@ private:
     };
 
     struct Node {
-        int size = 1;
+        long long size = 1;
 
         long long value;
         long long minValue;
         long long maxValue;
 
-        bool hasRev = false;
-
         Query addQuery = Query::EMPTY;
         Query assignQuery = Query::EMPTY;
 
@@ -127,84 +565,291 @@ private:
         long long lastValue;
 
         long long sum;
+
+#ifdef SPLAY_TREE_HASH
+        // hashes of the elements of the subtree in order and in reverse order
+        Hash hash;
+        Hash reverseHash;
+#endif
+
+        NodeId left = NIL;
+        NodeId right = NIL;
+        NodeId parent = NIL;
+
+        bool hasRev = false;
         Monotone monotone = CONSTANT;
 
-        Node *left = nullptr;
-        Node *right = nullptr;
-        Node *parent = nullptr;
-
-        explicit Node(long long value) : value(value),
-                                         sum(value),
-                                         minValue(value),
-                                         maxValue(value),
-                                         firstValue(value),
-                                         lastValue(value) {}
-
-
-        Node(long long value, Node *left, Node *right) : left(left),
-                                                         right(right),
-                                                         value(value),
-                                                         sum(value),
-                                                         minValue(value),
-                                                         maxValue(value),
-                                                         firstValue(value),
-                                                         lastValue(value) {}
-
-        Node(const Node &other) {
-            size = other.size;
-            value = other.value;
-            minValue = other.minValue;
-            maxValue = other.maxValue;
-            hasRev = other.hasRev;
-            addQuery = other.addQuery;
-            assignQuery = other.assignQuery;
-            firstValue = other.firstValue;
-            lastValue = other.lastValue;
-            sum = other.sum;
-            monotone = other.monotone;
-
-            if (other.left != nullptr) {
-                left = new Node(*other.left);
-            }
-            if (other.right != nullptr) {
-                right = new Node(*other.right);
-            }
-        }
-
-        Node &operator=(const Node &other) {
-            // copy-and-swap idiom
-            if (this == &other) {
-                return *this;
-            }
-            Node tmp(other);
-            swap(*this, tmp);
-            return *this;
+        Node() = default;
+
+        explicit Node(long long value) : Node(value, NIL, NIL) {}
+
+
+        Node(long long value, NodeId left, NodeId right) : value(value),
+                                                           minValue(value),
+                                                           maxValue(value),
+                                                           firstValue(value),
+                                                           lastValue(value),
+                                                           sum(value),
+                                                           left(left),
+                                                           right(right) {
+#ifdef SPLAY_TREE_HASH
+            hash = reverseHash = toHash_(value);
+#endif
+        }
+    };
+
+    // Owns the nodes of a tree, or of all sequences of a SplayForest, in one array.
+    // Released nodes are recycled through a free list linked by the left indices.
+    // Allocating may move the array, so no Node pointer may be kept across an allocation.
+    // The array lives on the heap, or in the out-of-core mode in a file mapped into memory,
+    // which holds the pool itself, so that it needs no rebuild when it is opened again.
+    struct NodePool {
+        // nodes[NIL] is never used, so that index 0 can mean no node
+        Node *nodes = nullptr;
+        size_t nodeCount = 1;
+        size_t capacity = 0;
+        NodeId freeList = NIL;
+        // tag timestamps are compared between trees merged together, so they are shared by the pool
+        long long lastQueryTime = 0;
+
+        // the mapped file, the nodes following its header
+        int fd = -1;
+        NodeFileHeader *fileHeader = nullptr;
+
+        NodePool() = default;
+
+        NodePool(const NodePool &) = delete;
+
+        NodePool &operator=(const NodePool &) = delete;
+
+        // A file that is not closed by closeFile stays marked as dirty and is not opened again.
+        ~NodePool() {
+            if (fileHeader != nullptr) {
+                munmap(fileHeader, mappedSize());
+                ::close(fd);
+            } else {
+                std::free(nodes);
+            }
+        }
+
+        bool isMapped() const {
+            return fileHeader != nullptr;
         }
 
-        ~Node() {
-            delete left;
-            delete right;
+        size_t mappedSize() const {
+            return NODE_FILE_HEADER_SIZE + capacity * sizeof(Node);
         }
 
-        friend void swap(Node &a, Node &b) {
-            std::swap(a.size, b.size);
-            std::swap(a.value, b.value);
-            std::swap(a.minValue, b.minValue);
-            std::swap(a.maxValue, b.maxValue);
-            std::swap(a.hasRev, b.hasRev);
-            std::swap(a.addQuery, b.addQuery);
-            std::swap(a.assignQuery, b.assignQuery);
-            std::swap(a.firstValue, b.firstValue);
-            std::swap(a.lastValue, b.lastValue);
-            std::swap(a.sum, b.sum);
-            std::swap(a.monotone, b.monotone);
-            std::swap(a.left, b.left);
-            std::swap(a.right, b.right);
-            std::swap(a.parent, b.parent);
+        NodeId allocate(long long value, NodeId left = NIL, NodeId right = NIL) {
+            if (freeList != NIL) {
+                NodeId node = freeList;
+                freeList = nodes[node].left;
+                nodes[node] = Node(value, left, right);
+                return node;
+            }
+            if (nodeCount > UINT32_MAX) {
+                throw std::length_error("SplayTree: node indices are exhausted");
+            }
+#ifdef SPLAY_TREE_HASH
+            HashPowers::reserve(nodeCount + 1);
+#endif
+            if (nodeCount >= capacity) {
+                grow(nodeCount + 1);
+            }
+            new(nodes + nodeCount) Node(value, left, right);
+            return nodeCount++;
+        }
+
+        void grow(size_t minCapacity) {
+            size_t newCapacity = std::max<size_t>({2 * capacity, isMapped() ? NODE_FILE_MIN_CAPACITY : 2, minCapacity});
+            if (!isMapped()) {
+                void *grown = std::realloc(nodes, newCapacity * sizeof(Node));
+                if (grown == nullptr) {
+                    throw std::bad_alloc();
+                }
+                nodes = static_cast<Node *>(grown);
+                capacity = newCapacity;
+                return;
+            }
+            // allocated rather than sparse, so that a full disk fails here instead of raising SIGBUS on a write
+            size_t newSize = NODE_FILE_HEADER_SIZE + newCapacity * sizeof(Node);
+            if (posix_fallocate(fd, mappedSize(), newSize - mappedSize()) != 0) {
+                throw std::bad_alloc();
+            }
+            void *data = mremap(fileHeader, mappedSize(), newSize, MREMAP_MAYMOVE);
+            if (data == MAP_FAILED) {
+                throw std::bad_alloc();
+            }
+            setMapping(data, newCapacity);
+        }
+
+        // Copies every node of source, free ones included, so that its indices stay valid in this pool.
+        void copyNodes(const NodePool &source) {
+            if (capacity < source.nodeCount) {
+                grow(source.nodeCount);
+            }
+            if (source.nodeCount > 1) {
+                std::memcpy(nodes + 1, source.nodes + 1, (source.nodeCount - 1) * sizeof(Node));
+            }
+            nodeCount = source.nodeCount;
+            freeList = source.freeList;
+            lastQueryTime = source.lastQueryTime;
+#ifdef SPLAY_TREE_HASH
+            HashPowers::reserve(nodeCount);
+#endif
+        }
+
+        // Returns the whole subtree to the free list.
+        void release(NodeId root) {
+            std::vector<NodeId> stack;
+            if (root != NIL) {
+                stack.push_back(root);
+            }
+            while (!stack.empty()) {
+                NodeId node = stack.back();
+                stack.pop_back();
+                if (nodes[node].left != NIL) {
+                    stack.push_back(nodes[node].left);
+                }
+                if (nodes[node].right != NIL) {
+                    stack.push_back(nodes[node].right);
+                }
+                nodes[node].left = freeList;
+                freeList = node;
+            }
+        }
+
+        // Maps the node file at path, creating it (and setting created) if it is empty or missing.
+        // The pool must be empty; an existing file brings its nodes, free list and tag clock.
+        bool openFile(const std::string &path, bool &created) {
+            int file = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+            if (file < 0) {
+                return false;
+            }
+            struct stat fileStat{};
+            if (fstat(file, &fileStat) != 0) {
+                ::close(file);
+                return false;
+            }
+            size_t fileSize = fileStat.st_size;
+            created = fileSize == 0;
+            if (created) {
+                fileSize = NODE_FILE_HEADER_SIZE + NODE_FILE_MIN_CAPACITY * sizeof(Node);
+            }
+            // every page of the mapping is backed by disk blocks, as in grow
+            if (fileSize >= NODE_FILE_HEADER_SIZE && posix_fallocate(file, 0, fileSize) != 0) {
+                // an empty file is as good as a missing one
+                if (created) {
+                    unlink(path.c_str());
+                }
+                ::close(file);
+                return false;
+            }
+            void *data = fileSize < NODE_FILE_HEADER_SIZE ? MAP_FAILED :
+                         mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            if (data == MAP_FAILED) {
+                ::close(file);
+                return false;
+            }
+
+            auto *header = static_cast<NodeFileHeader *>(data);
+            size_t fileCapacity = (fileSize - NODE_FILE_HEADER_SIZE) / sizeof(Node);
+            if (created) {
+                *header = NodeFileHeader();
+            }
+            bool valid = std::memcmp(header->magic, NodeFileHeader().magic, sizeof(header->magic)) == 0 &&
+                         header->version == NODE_FILE_VERSION &&
+                         header->flags == SNAPSHOT_SHAPE_FLAGS &&
+                         header->nodeSize == sizeof(Node) &&
+                         header->clean == 1 &&
+                         header->nodeCount >= 1 && header->nodeCount <= fileCapacity &&
+                         header->freeList < header->nodeCount && header->root < header->nodeCount;
+            if (!valid) {
+                munmap(data, fileSize);
+                ::close(file);
+                return false;
+            }
+
+            std::free(nodes);
+            fd = file;
+            setMapping(data, fileCapacity);
+            nodeCount = header->nodeCount;
+            freeList = header->freeList;
+            lastQueryTime = header->lastQueryTime;
+#ifdef SPLAY_TREE_HASH
+            HashPowers::reserve(nodeCount);
+#endif
+            // until closeFile, the nodes on disk may not match the header
+            header->clean = 0;
+            msync(header, NODE_FILE_HEADER_SIZE, MS_SYNC);
+            return true;
+        }
+
+        // Writes the pool back with root as the tree the file holds, and unmaps it.
+        bool closeFile(NodeId root) {
+            fileHeader->nodeCount = nodeCount;
+            fileHeader->freeList = freeList;
+            fileHeader->root = root;
+            fileHeader->lastQueryTime = lastQueryTime;
+            bool synced = msync(fileHeader, mappedSize(), MS_SYNC) == 0;
+            if (synced) {
+                fileHeader->clean = 1;
+                synced = msync(fileHeader, NODE_FILE_HEADER_SIZE, MS_SYNC) == 0;
+            }
+            munmap(fileHeader, mappedSize());
+            ::close(fd);
+            fd = -1;
+            fileHeader = nullptr;
+            nodes = nullptr;
+            nodeCount = 1;
+            capacity = 0;
+            freeList = NIL;
+            return synced;
+        }
+
+        void setMapping(void *data, size_t newCapacity) {
+            fileHeader = static_cast<NodeFileHeader *>(data);
+            nodes = reinterpret_cast<Node *>(static_cast<char *>(data) + NODE_FILE_HEADER_SIZE);
+            capacity = newCapacity;
+            // splaying jumps around the file, so read-ahead would mostly bring pages that are not needed
+            madvise(data, mappedSize(), MADV_RANDOM);
+        }
+
+        // For a mapped pool this is the size of the mapping, not what is resident.
+        size_t memoryUsage() const {
+            return sizeof(*this) + capacity * sizeof(Node);
         }
     };
 
-    static int getSize_(Node *node) {
+    Node *ptr_(NodeId node) const {
+        return node == NIL ? nullptr : pool_->nodes + node;
+    }
+
+    NodeId id_(const Node *node) const {
+        return node == nullptr ? NIL : static_cast<NodeId>(node - pool_->nodes);
+    }
+
+    Node *root_() const {
+        return ptr_(tree_);
+    }
+
+    void setRoot_(Node *root) {
+        tree_ = id_(root);
+    }
+
+    Node *left_(Node *node) const {
+        return ptr_(node->left);
+    }
+
+    Node *right_(Node *node) const {
+        return ptr_(node->right);
+    }
+
+    Node *parent_(Node *node) const {
+        return ptr_(node->parent);
+    }
+
+    static long long getSize_(Node *node) {
         return node == nullptr ? 0 : node->size;
     }
 
@@ -221,14 +866,14 @@ private:
     }
 
 
-    static void setParent_(Node *node, Node *parent) {
+    void setParent_(Node *node, Node *parent) {
         if (node == nullptr) {
             return;
         }
-        node->parent = parent;
+        node->parent = id_(parent);
     }
 
-    static void pushReverse_(Node *node) {
+    void pushReverse_(Node *node) {
         if (node == nullptr || !node->hasRev) {
             return;
         }
@@ -241,19 +886,22 @@ private:
 
         std::swap(node->lastValue, node->firstValue);
         std::swap(node->left, node->right);
+#ifdef SPLAY_TREE_HASH
+        std::swap(node->hash, node->reverseHash);
+#endif
 
-        if (node->left != nullptr) {
-            node->left->hasRev ^= true;
+        if (node->left != NIL) {
+            left_(node)->hasRev ^= true;
         }
-        if (node->right != nullptr) {
-            node->right->hasRev ^= true;
+        if (node->right != NIL) {
+            right_(node)->hasRev ^= true;
         }
 
         node->hasRev = false;
     }
 
 
-    static void pushAssign_(Node *node) {
+    void pushAssign_(Node *node) {
         if (node == nullptr || node->assignQuery == Query::EMPTY) {
             return;
         }
@@ -275,13 +923,16 @@ private:
         node->minValue = assignValue;
         node->maxValue = assignValue;
         node->monotone = CONSTANT;
+#ifdef SPLAY_TREE_HASH
+        node->hash = node->reverseHash = repeatedHash_(assignValue, node->size);
+#endif
 
-        if (node->left != nullptr) {
-            node->left->assignQuery = node->assignQuery;
+        if (node->left != NIL) {
+            left_(node)->assignQuery = node->assignQuery;
         }
 
-        if (node->right != nullptr) {
-            node->right->assignQuery = node->assignQuery;
+        if (node->right != NIL) {
+            right_(node)->assignQuery = node->assignQuery;
         }
 
         node->assignQuery = Query::EMPTY;
@@ -297,7 +948,7 @@ private:
         }
     }
 
-    static void pushAdd_(Node *node) {
+    void pushAdd_(Node *node) {
         if (node == nullptr || node->addQuery == Query::EMPTY) {
             return;
         }
@@ -309,19 +960,24 @@ private:
         node->lastValue += addValue;
         node->minValue += addValue;
         node->maxValue += addValue;
-
-        if (node->left != nullptr) {
-            updateAddQuery_(node->left, node->addQuery);
+#ifdef SPLAY_TREE_HASH
+        Hash addHash = repeatedHash_(addValue, node->size);
+        node->hash = addHash_(node->hash, addHash);
+        node->reverseHash = addHash_(node->reverseHash, addHash);
+#endif
+
+        if (node->left != NIL) {
+            updateAddQuery_(left_(node), node->addQuery);
         }
 
-        if (node->right != nullptr) {
-            updateAddQuery_(node->right, node->addQuery);
+        if (node->right != NIL) {
+            updateAddQuery_(right_(node), node->addQuery);
         }
 
         node->addQuery = Query::EMPTY;
     }
 
-    static void push_(Node *node) {
+    void push_(Node *node) {
         if (node == nullptr) {
             return;
         }
@@ -357,14 +1013,16 @@ private:
         return false;
     }
 
-    static Monotone getMonotone_(Node *node) {
+    Monotone getMonotone_(Node *node) {
+        Node *left = left_(node);
+        Node *right = right_(node);
 
-        if (containsConstantSequence_(node->left) && containsConstantSequence_(node->right)) {
+        if (containsConstantSequence_(left) && containsConstantSequence_(right)) {
             bool isConstant = true;
-            if (node->right != nullptr && node->right->minValue != node->value) {
+            if (right != nullptr && right->minValue != node->value) {
                 isConstant = false;
             }
-            if (node->left != nullptr && node->left->minValue != node->value) {
+            if (left != nullptr && left->minValue != node->value) {
                 isConstant = false;
             }
             if (isConstant) {
@@ -372,21 +1030,21 @@ private:
             }
         }
 
-        if (containsNonDecreasingSequence_(node->left) && containsNonDecreasingSequence_(node->right)) {
-            if (node->right != nullptr && node->right->minValue < node->value) {
+        if (containsNonDecreasingSequence_(left) && containsNonDecreasingSequence_(right)) {
+            if (right != nullptr && right->minValue < node->value) {
                 return NONE;
             }
-            if (node->left != nullptr && node->left->maxValue > node->value) {
+            if (left != nullptr && left->maxValue > node->value) {
                 return NONE;
             }
             return NON_DECREASING;
         }
 
-        if (containsNonIncreasingSequence_(node->left) && containsNonIncreasingSequence_(node->right)) {
-            if (node->right != nullptr && node->right->maxValue > node->value) {
+        if (containsNonIncreasingSequence_(left) && containsNonIncreasingSequence_(right)) {
+            if (right != nullptr && right->maxValue > node->value) {
                 return NONE;
             }
-            if (node->left != nullptr && node->left->minValue < node->value) {
+            if (left != nullptr && left->minValue < node->value) {
                 return NONE;
             }
             return NON_INCREASING;
@@ -395,77 +1053,91 @@ private:
         return NONE;
     }
 
-    static void update_(Node *node) {
+    void update_(Node *node) {
         if (node == nullptr) {
             return;
         }
 
-        setParent_(node->left, node);
-        setParent_(node->right, node);
+        Node *left = left_(node);
+        Node *right = right_(node);
 
-        push_(node->left);
-        push_(node->right);
+        setParent_(left, node);
+        setParent_(right, node);
 
-        node->sum = getSum_(node->left) + getSum_(node->right) + node->value;
-        node->size = getSize_(node->left) + getSize_(node->right) + 1;
-        node->minValue = std::min(std::min(getMinValue_(node->left), getMinValue_(node->right)), node->value);
-        node->maxValue = std::max(std::max(getMaxValue_(node->left), getMaxValue_(node->right)), node->value);
-        node->monotone = getMonotone_(node);
+        push_(left);
+        push_(right);
 
-        if (node->left != nullptr) {
-            node->firstValue = node->left->firstValue;
+        node->sum = getSum_(left) + getSum_(right) + node->value;
+        node->size = getSize_(left) + getSize_(right) + 1;
+        node->minValue = std::min(std::min(getMinValue_(left), getMinValue_(right)), node->value);
+        node->maxValue = std::max(std::max(getMaxValue_(left), getMaxValue_(right)), node->value);
+        node->monotone = getMonotone_(node);
+#ifdef SPLAY_TREE_HASH
+        Hash value = toHash_(node->value);
+        long long leftSize = getSize_(left);
+        long long rightSize = getSize_(right);
+        node->hash = addHash_(addHash_(multiplyHash_(getHash_(left), HashPowers::power(rightSize + 1)),
+                                       multiplyHash_(value, HashPowers::power(rightSize))), getHash_(right));
+        node->reverseHash = addHash_(addHash_(multiplyHash_(getReverseHash_(right), HashPowers::power(leftSize + 1)),
+                                              multiplyHash_(value, HashPowers::power(leftSize))),
+                                     getReverseHash_(left));
+#endif
+
+        if (left != nullptr) {
+            node->firstValue = left->firstValue;
         } else {
             node->firstValue = node->value;
         }
 
-        if (node->right != nullptr) {
-            node->lastValue = node->right->lastValue;
+        if (right != nullptr) {
+            node->lastValue = right->lastValue;
         } else {
             node->lastValue = node->value;
         }
     }
 
-    static void rotate_(Node *parent, Node *child) {
-        Node *grandParent = parent->parent;
+    void rotate_(Node *parent, Node *child) {
+        Node *grandParent = parent_(parent);
         if (grandParent != nullptr) {
-            if (grandParent->left == parent) {
-                grandParent->left = child;
+            if (left_(grandParent) == parent) {
+                grandParent->left = id_(child);
             } else {
-                grandParent->right = child;
+                grandParent->right = id_(child);
             }
         }
 
-        if (parent->left == child) {
+        if (left_(parent) == child) {
             parent->left = child->right;
-            child->right = parent;
+            child->right = id_(parent);
         } else {
             parent->right = child->left;
-            child->left = parent;
+            child->left = id_(parent);
         }
 
-        update_(child);
+        // bottom-up, so that no aggregate (in particular no size) is ever computed from a stale child
         update_(parent);
+        update_(child);
         update_(grandParent);
 
         setParent_(child, grandParent);
     }
 
-    static Node *splay_(Node *v) {
+    Node *splay_(Node *v) {
         push_(v);
-        if (v->parent == nullptr) {
+        if (v->parent == NIL) {
             update_(v);
             return v;
         }
 
-        Node *parent = v->parent;
-        Node *grandParent = parent->parent;
+        Node *parent = parent_(v);
+        Node *grandParent = parent_(parent);
 
         if (grandParent == nullptr) {
             rotate_(parent, v);
             update_(v);
             return v;
         }
-        bool zigZig = (grandParent->left == parent) == (parent->left == v);
+        bool zigZig = (left_(grandParent) == parent) == (left_(parent) == v);
         if (zigZig) {
             rotate_(grandParent, parent);
             rotate_(parent, v);
@@ -478,30 +1150,30 @@ private:
         return splay_(v);
     }
 
-    static Node *find_(Node *v, int i) {
+    Node *find_(Node *v, long long i) {
         push_(v);
         if (v == nullptr) {
             return nullptr;
         }
-        int currentSize = getSize_(v->left) + 1;
+        long long currentSize = getSize_(left_(v)) + 1;
 
         if (i == currentSize) {
             return v;
         }
-        if (i < currentSize && v->left != nullptr) {
-            return find_(v->left, i);
+        if (i < currentSize && v->left != NIL) {
+            return find_(left_(v), i);
         }
-        if (i > currentSize && v->right != nullptr) {
-            return find_(v->right, i - currentSize);
+        if (i > currentSize && v->right != NIL) {
+            return find_(right_(v), i - currentSize);
         }
         return v;
     }
 
-    static long long elementAt_(Node *node, int i) {
+    long long elementAt_(Node *node, long long i) {
         return find_(node, i)->value;
     }
 
-    static std::pair<Node *, Node *> split_(Node *root, int i) {
+    std::pair<Node *, Node *> split_(Node *root, long long i) {
         if (root == nullptr) {
             return {nullptr, nullptr};
         }
@@ -509,19 +1181,19 @@ private:
         root = splay_(find_(root, i));
 
         if (getSize_(root) < i) {
-            Node *right = root->right;
+            Node *right = right_(root);
             setParent_(right, nullptr);
 
-            root->right = nullptr;
+            root->right = NIL;
             update_(root);
             update_(right);
 
             return {root, right};
         } else {
-            Node *left = root->left;
+            Node *left = left_(root);
             setParent_(left, nullptr);
 
-            root->left = nullptr;
+            root->left = NIL;
             update_(root);
             update_(left);
 
@@ -529,7 +1201,7 @@ private:
         }
     }
 
-    static Node *merge_(Node *left, Node *right) {
+    Node *merge_(Node *left, Node *right) {
         push_(left);
         push_(right);
 
@@ -542,7 +1214,7 @@ private:
 
         left = splay_(find_(left, getSize_(left)));
 
-        left->right = right;
+        left->right = id_(right);
 
 
         update_(right);
@@ -551,17 +1223,185 @@ private:
         return left;
     }
 
-    static void traverse_(Node *root, const std::function<void(Node *)> &operation) {
-        push_(root);
-        if (root == nullptr) {
-            return;
+    // In order, with an explicit stack: a tree built by appending is a chain as deep as the sequence is long.
+    void traverse_(Node *root, const std::function<void(Node *)> &operation) {
+        std::vector<Node *> stack;
+        Node *node = root;
+        while (node != nullptr || !stack.empty()) {
+            while (node != nullptr) {
+                push_(node);
+                stack.push_back(node);
+                node = left_(node);
+            }
+            node = stack.back();
+            stack.pop_back();
+            operation(node);
+            node = right_(node);
+        }
+    }
+
+    Node *build_(const long long *values, size_t count) {
+        if (count == 0) {
+            return nullptr;
+        }
+        size_t middle = count / 2;
+        NodeId left = id_(build_(values, middle));
+        NodeId right = id_(build_(values + middle + 1, count - middle - 1));
+        Node *root = ptr_(pool_->allocate(values[middle], left, right));
+        update_(root);
+        return root;
+    }
+
+    // Copies a subtree of another pool (which may be this one) and returns the root of the copy.
+    // Iterative, like traverse_, since the subtree may be as deep as it is large.
+    NodeId clone_(NodeId node, const NodePool &source) {
+        NodeId root = NIL;
+        // source nodes still to copy, with the copy of their parent and whether they are its left child
+        std::vector<std::tuple<NodeId, NodeId, bool>> stack;
+        if (node != NIL) {
+            stack.emplace_back(node, NIL, false);
+        }
+        while (!stack.empty()) {
+            NodeId original;
+            NodeId parent;
+            bool isLeft;
+            std::tie(original, parent, isLeft) = stack.back();
+            stack.pop_back();
+
+            NodeId copy = pool_->allocate(0);
+            Node *copyNode = ptr_(copy);
+            *copyNode = source.nodes[original];
+            copyNode->left = NIL;
+            copyNode->right = NIL;
+            copyNode->parent = parent;
+            if (parent == NIL) {
+                root = copy;
+            } else if (isLeft) {
+                ptr_(parent)->left = copy;
+            } else {
+                ptr_(parent)->right = copy;
+            }
+
+            if (source.nodes[original].right != NIL) {
+                stack.emplace_back(source.nodes[original].right, copy, false);
+            }
+            if (source.nodes[original].left != NIL) {
+                stack.emplace_back(source.nodes[original].left, copy, true);
+            }
+        }
+        return root;
+    }
+
+    void writeNodeRecords_(Node *root, std::ostream &out) {
+        std::vector<NodeRecord> buffer;
+        buffer.reserve(SNAPSHOT_BUFFER_SIZE);
+
+        std::vector<Node *> stack;
+        if (root != nullptr) {
+            stack.push_back(root);
+        }
+        while (!stack.empty()) {
+            Node *node = stack.back();
+            stack.pop_back();
+
+            NodeRecord record{};
+            record.size = node->size;
+            record.value = node->value;
+            record.minValue = node->minValue;
+            record.maxValue = node->maxValue;
+            record.firstValue = node->firstValue;
+            record.lastValue = node->lastValue;
+            record.sum = node->sum;
+            record.addTime = node->addQuery.time;
+            record.addValue = node->addQuery.value;
+            record.assignTime = node->assignQuery.time;
+            record.assignValue = node->assignQuery.value;
+#ifdef SPLAY_TREE_HASH
+            record.hash = node->hash;
+            record.reverseHash = node->reverseHash;
+#endif
+            record.monotone = node->monotone;
+            record.hasRev = node->hasRev;
+            record.children = (node->left != NIL ? 1 : 0) | (node->right != NIL ? 2 : 0);
+            buffer.push_back(record);
+
+            if (buffer.size() == SNAPSHOT_BUFFER_SIZE) {
+                out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * sizeof(NodeRecord));
+                buffer.clear();
+            }
+
+            if (node->right != NIL) {
+                stack.push_back(right_(node));
+            }
+            if (node->left != NIL) {
+                stack.push_back(left_(node));
+            }
+        }
+        out.write(reinterpret_cast<const char *>(buffer.data()), buffer.size() * sizeof(NodeRecord));
+    }
+
+    // Rebuilds the nodes written by writeNodeRecords_. Returns false, releasing what was read,
+    // if the records do not form exactly one tree.
+    bool readNodeRecords_(const NodeRecord *records, size_t count, NodeId &root) {
+        root = NIL;
+        // nodes whose children have not been read yet, with the flags of the missing children
+        std::vector<std::pair<NodeId, uint8_t>> stack;
+
+        for (size_t i = 0; i < count; i++) {
+            const NodeRecord &record = records[i];
+            if ((i > 0 && stack.empty()) || (record.children & ~3) != 0 || record.monotone > NONE) {
+                pool_->release(root);
+                root = NIL;
+                return false;
+            }
+            NodeId id = pool_->allocate(record.value);
+            Node *node = ptr_(id);
+            node->size = record.size;
+            node->minValue = record.minValue;
+            node->maxValue = record.maxValue;
+            node->firstValue = record.firstValue;
+            node->lastValue = record.lastValue;
+            node->sum = record.sum;
+            node->addQuery = {record.addTime, record.addValue};
+            node->assignQuery = {record.assignTime, record.assignValue};
+#ifdef SPLAY_TREE_HASH
+            node->hash = record.hash;
+            node->reverseHash = record.reverseHash;
+#endif
+            node->monotone = static_cast<Monotone>(record.monotone);
+            node->hasRev = record.hasRev;
+
+            if (stack.empty()) {
+                root = id;
+            } else {
+                auto &top = stack.back();
+                Node *parent = ptr_(top.first);
+                node->parent = top.first;
+                if (top.second & 1) {
+                    parent->left = id;
+                    top.second &= ~1;
+                } else {
+                    parent->right = id;
+                    top.second &= ~2;
+                }
+                if (top.second == 0) {
+                    stack.pop_back();
+                }
+            }
+
+            if (record.children != 0) {
+                stack.emplace_back(id, record.children);
+            }
         }
-        traverse_(root->left, operation);
-        operation(root);
-        traverse_(root->right, operation);
+        if (!stack.empty()) {
+            pool_->release(root);
+            root = NIL;
+            return false;
+        }
+        return true;
     }
 
-    static std::tuple<Node *, Node *, Node *> extractSegment_(Node *root, int l, int r) {
+    std::tuple<Node *, Node *, Node *> extractSegment_(Node *root, long long l, long long r) {
         Node *t1;
         Node *t2;
         Node *t3;
@@ -577,64 +1417,67 @@ private:
         return std::make_tuple(t1, t2, t3);
     }
 
-    static Node *makeOperationOnSubSegment_(Node *root, int l, int r,
-                                            const std::function<Node *(Node *)> &operation) {
+    Node *makeOperationOnSubSegment_(Node *root, long long l, long long r,
+                                     const std::function<Node *(Node *)> &operation) {
         auto splitted = extractSegment_(root, l, r);
         Node *t1 = std::get<0>(splitted);
         Node *t2 = std::get<1>(splitted);
         Node *t3 = std::get<2>(splitted);
 
+        // the operation may allocate nodes and thus move the ones of t1 and t3
+        NodeId t1Id = id_(t1);
+        NodeId t3Id = id_(t3);
         t2 = operation(t2);
-        return merge_(merge_(t1, t2), t3);
+        return merge_(merge_(ptr_(t1Id), t2), ptr_(t3Id));
     }
 
-    static Node *insert_(Node *root, int pos, long long value) {
+    Node *insert_(Node *root, long long pos, long long value) {
         if (root == nullptr) {
-            return new Node(value);
+            return ptr_(pool_->allocate(value));
         }
 
         auto splitted = split_(root, pos);
 
-        Node *left = splitted.first;
-        Node *right = splitted.second;
-        root = new Node(value, left, right);
+        NodeId left = id_(splitted.first);
+        NodeId right = id_(splitted.second);
+        root = ptr_(pool_->allocate(value, left, right));
         update_(root);
         return root;
     }
 
-    static Node *remove_(Node *node, int i) {
-        return makeOperationOnSubSegment_(node, i, i, [](Node *treeSegment) {
-            delete treeSegment;
+    Node *remove_(Node *node, long long i) {
+        return makeOperationOnSubSegment_(node, i, i, [this](Node *treeSegment) {
+            pool_->release(id_(treeSegment));
             return nullptr;
         });
     }
 
 
-    static Node *add_(Node *node, int l, int r, long long x, int &lastQueryTime) {
-        return makeOperationOnSubSegment_(node, l, r, [&lastQueryTime, &x](Node *treeSegment) {
+    Node *add_(Node *node, long long l, long long r, long long x, long long &lastQueryTime) {
+        return makeOperationOnSubSegment_(node, l, r, [this, &lastQueryTime, &x](Node *treeSegment) {
             push_(treeSegment);
             treeSegment->addQuery = {++lastQueryTime, x};
             return treeSegment;
         });
     }
 
-    static Node *assign_(Node *node, int l, int r, long long x, int &lastQueryTime) {
-        return makeOperationOnSubSegment_(node, l, r, [&lastQueryTime, &x](Node *treeSegment) {
+    Node *assign_(Node *node, long long l, long long r, long long x, long long &lastQueryTime) {
+        return makeOperationOnSubSegment_(node, l, r, [this, &lastQueryTime, &x](Node *treeSegment) {
             push_(treeSegment);
             treeSegment->assignQuery = {++lastQueryTime, x};
             return treeSegment;
         });
     }
 
-    static Node *reverse_(Node *node, int l, int r) {
-        return makeOperationOnSubSegment_(node, l, r, [](Node *treeSegment) {
+    Node *reverse_(Node *node, long long l, long long r) {
+        return makeOperationOnSubSegment_(node, l, r, [this](Node *treeSegment) {
             push_(treeSegment);
             treeSegment->hasRev ^= true;
             return treeSegment;
         });
     }
 
-    static std::pair<long long, Node *> getSum_(Node *node, int l, int r) {
+    std::pair<long long, Node *> getSum_(Node *node, long long l, long long r) {
         long long sum;
         node = makeOperationOnSubSegment_(node, l, r, [&sum](Node *treeSegment) {
             sum = getSum_(treeSegment);
@@ -644,7 +1487,7 @@ private:
     }
 
 
-    static std::pair<long long, Node *> getMin_(Node *node, int l, int r) {
+    std::pair<long long, Node *> getMin_(Node *node, long long l, long long r) {
         long long minValue;
         node = makeOperationOnSubSegment_(node, l, r, [&minValue](Node *treeSegment) {
             minValue = getMinValue_(treeSegment);
@@ -653,29 +1496,29 @@ private:
         return {minValue, node};
     }
 
-    static int indexOf_(Node *root, Node *v) {
+    long long indexOf_(Node *root, Node *v) {
         std::vector<Node *> path = {v};
-        while (v->parent != nullptr) {
-            path.push_back(v->parent);
-            v = v->parent;
+        while (v->parent != NIL) {
+            path.push_back(parent_(v));
+            v = parent_(v);
         }
         std::reverse(path.begin(), path.end());
-        int pos = getSize_(root->left) + 1;
-        for (int i = 0; i + 1 < path.size(); i++) {
+        long long pos = getSize_(left_(root)) + 1;
+        for (size_t i = 0; i + 1 < path.size(); i++) {
             Node *currentVertex = path[i];
             Node *child = path[i + 1];
             push_(currentVertex);
-            if (child == currentVertex->left) {
-                pos -= getSize_(currentVertex->left->right) + 1;
+            if (child == left_(currentVertex)) {
+                pos -= getSize_(right_(left_(currentVertex))) + 1;
             } else {
-                pos += getSize_(currentVertex->right->left) + 1;
+                pos += getSize_(left_(right_(currentVertex))) + 1;
             }
         }
         return pos;
     }
 
 
-    static int getMonotoneSuffix_(Node *v, Monotone type) {
+    long long getMonotoneSuffix_(Node *v, Monotone type) {
         push_(v);
         update_(v);
 
@@ -686,27 +1529,30 @@ private:
             return getSize_(v);
         }
 
-        int ans = getMonotoneSuffix_(v->right, type);
+        long long ans = getMonotoneSuffix_(right_(v), type);
 
-        if (getSize_(v->right) == ans) {
-            if (type == NON_INCREASING && (v->right ? v->value >= v->right->firstValue : true)) {
+        if (getSize_(right_(v)) == ans) {
+            Node *right = right_(v);
+            if (type == NON_INCREASING && (right ? v->value >= right->firstValue : true)) {
                 ans++;
                 update_(v);
-                if ((v->left ? v->left->lastValue >= v->value : true)) {
-                    ans += getMonotoneSuffix_(v->left, type);
+                Node *left = left_(v);
+                if ((left ? left->lastValue >= v->value : true)) {
+                    ans += getMonotoneSuffix_(left, type);
                 }
-            } else if (type == NON_DECREASING && (v->right ? v->value <= v->right->firstValue : true)) {
+            } else if (type == NON_DECREASING && (right ? v->value <= right->firstValue : true)) {
                 ans++;
                 update_(v);
-                if ((v->left ? v->left->lastValue <= v->value : true)) {
-                    ans += getMonotoneSuffix_(v->left, type);
+                Node *left = left_(v);
+                if ((left ? left->lastValue <= v->value : true)) {
+                    ans += getMonotoneSuffix_(left, type);
                 }
             }
         }
-        return std::max(ans, 1);
+        return std::max(ans, 1LL);
     }
 
-    static Node *swapSegments_(Node *root, int l1, int r1, int l2, int r2) {
+    Node *swapSegments_(Node *root, long long l1, long long r1, long long l2, long long r2) {
         auto splitted1 = extractSegment_(root, l1, r1);
 
         Node *t1 = std::get<0>(splitted1);
@@ -723,7 +1569,16 @@ private:
         return merge_(merge_(merge_(merge_(t1, t5), t4), t2), t6);
     }
 
-    static Node *
+    Node *moveSegment_(Node *root, long long l, long long r, long long dst) {
+        auto splitted = extractSegment_(root, l, r);
+        Node *segment = std::get<1>(splitted);
+        Node *rest = merge_(std::get<0>(splitted), std::get<2>(splitted));
+
+        auto spl = split_(rest, dst);
+        return merge_(merge_(spl.first, segment), spl.second);
+    }
+
+    Node *
     getClosestNodeByValue_(Node *node, long long value, const std::function<bool(long long, long long)> &comparator) {
         if (node == nullptr) {
             return nullptr;
@@ -732,35 +1587,73 @@ private:
         push_(node);
 
         if (comparator(node->value, value)) {
-            Node *rightAns = getClosestNodeByValue_(node->right, value, comparator);
+            Node *rightAns = getClosestNodeByValue_(right_(node), value, comparator);
             return rightAns != nullptr ? rightAns : node;
         }
 
-        return getClosestNodeByValue_(node->left, value, comparator);
+        return getClosestNodeByValue_(left_(node), value, comparator);
     }
 
-    static std::pair<Node *, Node *> getMinimalGreater_(Node *node, int l, int r, long long value) {
+    std::pair<Node *, Node *> getMinimalGreater_(Node *node, long long l, long long r, long long value) {
         Node *minimalGreater;
-        node = makeOperationOnSubSegment_(node, l, r, [&minimalGreater, &value](Node *treeSegment) {
+        node = makeOperationOnSubSegment_(node, l, r, [this, &minimalGreater, &value](Node *treeSegment) {
             minimalGreater = getClosestNodeByValue_(treeSegment, value, std::greater<>());
             return treeSegment;
         });
         return {minimalGreater, node};
     }
 
-    static std::pair<Node *, Node *> getMaximalLess_(Node *node, int l, int r, long long value) {
+    std::pair<Node *, Node *> getMaximalLess_(Node *node, long long l, long long r, long long value) {
         Node *maximalLess;
-        node = makeOperationOnSubSegment_(node, l, r, [&maximalLess, &value](Node *treeSegment) {
+        node = makeOperationOnSubSegment_(node, l, r, [this, &maximalLess, &value](Node *treeSegment) {
             maximalLess = getClosestNodeByValue_(treeSegment, value, std::less<>());
             return treeSegment;
         });
         return {maximalLess, node};
     }
 
-    static Node *makePermutation_(Node *root, int l, int r, bool isNext) {
-        return makeOperationOnSubSegment_(root, l, r, [&isNext](Node *tree) {
-            int monotoneSuffixLength = getMonotoneSuffix_(tree, isNext ? NON_INCREASING : NON_DECREASING);
-            int pivotPosition = std::max(1, tree->size - monotoneSuffixLength);
+    std::pair<long long, Node *> bound_(Node *node, long long l, long long r, long long value,
+                                        const std::function<bool(long long, long long)> &comparator) {
+        long long count;
+        node = makeOperationOnSubSegment_(node, l, r, [this, &count, &value, &comparator](Node *treeSegment) {
+            Node *closestNode = getClosestNodeByValue_(treeSegment, value, comparator);
+            count = closestNode == nullptr ? 0 : indexOf_(treeSegment, closestNode);
+            return treeSegment;
+        });
+        return {count, node};
+    }
+
+    Node *sort_(Node *root, long long l, long long r, bool ascending) {
+        return makeOperationOnSubSegment_(root, l, r, [this, &ascending](Node *treeSegment) {
+            push_(treeSegment);
+            if (containsSequence_(treeSegment, ascending ? NON_DECREASING : NON_INCREASING)) {
+                return treeSegment;
+            }
+            if (containsSequence_(treeSegment, ascending ? NON_INCREASING : NON_DECREASING)) {
+                treeSegment->hasRev ^= true;
+                return treeSegment;
+            }
+
+            std::vector<long long> values;
+            values.reserve(getSize_(treeSegment));
+            traverse_(treeSegment, [&values](Node *node) {
+                values.push_back(node->value);
+            });
+            pool_->release(id_(treeSegment));
+
+            if (ascending) {
+                std::sort(values.begin(), values.end());
+            } else {
+                std::sort(values.begin(), values.end(), std::greater<>());
+            }
+            return build_(values.data(), values.size());
+        });
+    }
+
+    Node *makePermutation_(Node *root, long long l, long long r, bool isNext) {
+        return makeOperationOnSubSegment_(root, l, r, [this, &isNext](Node *tree) {
+            long long monotoneSuffixLength = getMonotoneSuffix_(tree, isNext ? NON_INCREASING : NON_DECREASING);
+            long long pivotPosition = std::max(1LL, tree->size - monotoneSuffixLength);
             long long pivotValue = elementAt_(tree, pivotPosition);
 
             std::pair<Node *, Node *> res;
@@ -777,7 +1670,7 @@ private:
                 return reverse_(tree, 1, getSize_(tree));
             }
 
-            int indexOfClosestNode = indexOf_(tree, closestNode);
+            long long indexOfClosestNode = indexOf_(tree, closestNode);
 
             tree = swapSegments_(tree, pivotPosition, pivotPosition, indexOfClosestNode, indexOfClosestNode);
 
@@ -786,103 +1679,1110 @@ private:
     }
 
 
-    static Node *nextPermutation_(Node *root, int l, int r) {
+    Node *nextPermutation_(Node *root, long long l, long long r) {
         return makePermutation_(root, l, r, true);
     }
 
-    static Node *prevPermutation_(Node *root, int l, int r) {
+    Node *prevPermutation_(Node *root, long long l, long long r) {
         return makePermutation_(root, l, r, false);
     }
 };
 
 const SplayTree::Query SplayTree::Query::EMPTY = {0, 0};
 
-void readTree(SplayTree &tree, std::istream &in) {
-    size_t treeSize;
-    in >> treeSize;
-    for (size_t i = 0; i < treeSize; i++) {
-        long long x;
-        in >> x;
-        tree.insert(tree.size(), x);
-    }
-}
+#ifdef SPLAY_TREE_HASH
+std::atomic<SplayTree::HashPowers::Entry *> SplayTree::HashPowers::blocks[SplayTree::HashPowers::MAX_BLOCKS];
+std::atomic<size_t> SplayTree::HashPowers::count(0);
+std::mutex SplayTree::HashPowers::growMutex;
+#endif
 
-void printTree(SplayTree &tree, std::ostream &out) {
-    auto treeVector = tree.toVector();
+
+// Many sequences sharing one node pool. Sequences are addressed by handles and expose
+// all SplayTree operations; they can also be concatenated and split in amortized O(log n).
+class SplayForest {
+public:
+    using Handle = size_t;
+
+    SplayForest() : pool_(new SplayTree::NodePool()) {}
+
+    SplayForest(const SplayForest &other) = delete;
+
+    SplayForest &operator=(const SplayForest &other) = delete;
+
+    Handle create() {
+        if (!freeHandles_.empty()) {
+            Handle handle = freeHandles_.back();
+            freeHandles_.pop_back();
+            return handle;
+        }
+        // in place, since moving a sequence would copy its nodes out of the pool
+        sequences_.emplace_back(*pool_);
+        return sequences_.size() - 1;
+    }
+
+    Handle create(const std::vector<long long> &v) {
+        Handle handle = create();
+        SplayTree &sequence = sequences_[handle];
+        sequence.setRoot_(sequence.build_(v.data(), v.size()));
+        return handle;
+    }
+
+    // Frees the nodes of the sequence; the handle may be returned by a later create.
+    void release(Handle handle) {
+        pool_->release(sequences_[handle].tree_);
+        sequences_[handle].tree_ = SplayTree::NIL;
+        freeHandles_.push_back(handle);
+    }
+
+    SplayTree &operator[](Handle handle) {
+        return sequences_[handle];
+    }
+
+    // Appends the elements of src to dst, leaving src empty.
+    void concat(Handle dst, Handle src) {
+        if (dst == src) {
+            return;
+        }
+        SplayTree &sequence = sequences_[dst];
+        assert(sequence.pool_ == pool_.get() && sequences_[src].pool_ == pool_.get());
+        sequence.setRoot_(sequence.merge_(sequence.root_(), sequences_[src].root_()));
+        sequences_[src].tree_ = SplayTree::NIL;
+    }
+
+    // Moves the elements from position i on into a new sequence and returns its handle.
+    Handle split(Handle handle, size_t i) {
+        Handle suffix = create();
+        SplayTree &sequence = sequences_[handle];
+        assert(sequence.pool_ == pool_.get() && sequences_[suffix].pool_ == pool_.get());
+        auto splitted = sequence.split_(sequence.root_(), i + 1);
+        sequence.setRoot_(splitted.first);
+        sequences_[suffix].setRoot_(splitted.second);
+        return suffix;
+    }
+
+    size_t sequenceCount() const {
+        return sequences_.size() - freeHandles_.size();
+    }
+
+    size_t memoryUsage() const {
+        return sizeof(*this) + pool_->memoryUsage() + sequences_.size() * sizeof(SplayTree) +
+               freeHandles_.capacity() * sizeof(Handle);
+    }
+
+    double memoryPerSequence() const {
+        return sequenceCount() == 0 ? 0 : static_cast<double>(memoryUsage()) / sequenceCount();
+    }
+
+private:
+    // declared before the sequences, which give their nodes back to it when destroyed
+    std::unique_ptr<SplayTree::NodePool> pool_;
+    std::deque<SplayTree> sequences_;
+    std::vector<Handle> freeHandles_;
+};
+
+void readTree(SplayTree &tree, std::istream &in) {
+    size_t treeSize;
+    in >> treeSize;
+    for (size_t i = 0; i < treeSize; i++) {
+        long long x;
+        in >> x;
+        tree.insert(tree.size(), x);
+    }
+}
+
+void printTree(SplayTree &tree, std::ostream &out) {
+    auto treeVector = tree.toVector();
     for (long long element : treeVector) {
         out << element << " ";
     }
 }
 
-void processQuery(SplayTree &tree, std::istream &in, std::ostream &out) {
-    int type;
-    in >> type;
+struct ParsedQuery {
+    int type = 0;
+    // arguments in the order they appear in the input
+    long long args[4] = {};
+};
+
+int getArgumentsCount(int type) {
     switch (type) {
-        case 1: {
-            int l, r;
-            in >> l >> r;
-            out << tree.getSum(l, r) << "\n";
+        case 3:
+            return 1;
+        case 1:
+        case 2:
+        case 6:
+        case 7:
+        case 8:
+            return 2;
+        case 4:
+        case 5:
+        case 10:
+        case 11:
+            return 3;
+        case 9:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+ParsedQuery readQuery(std::istream &in) {
+    ParsedQuery query;
+    in >> query.type;
+    for (int i = 0; i < getArgumentsCount(query.type); i++) {
+        in >> query.args[i];
+    }
+    return query;
+}
+
+// Executes the query and returns the answer of a sum query (0 for the other types).
+long long executeQuery(SplayTree &tree, const ParsedQuery &query) {
+    const long long *a = query.args;
+    switch (query.type) {
+        case 1:
+            return tree.getSum(a[0], a[1]);
+        case 2:
+            tree.insert(a[1], a[0]);
             break;
-        }
-        case 2: {
-            int pos, x;
-            in >> x >> pos;
-            tree.insert(pos, x);
+        case 3:
+            tree.remove(a[0]);
             break;
-        }
-        case 3: {
-            int pos;
-            in >> pos;
-            tree.remove(pos);
+        case 4:
+            tree.assign(a[1], a[2], a[0]);
             break;
-        }
-        case 4: {
-            int x, l, r;
-            in >> x >> l >> r;
-            tree.assign(l, r, x);
+        case 5:
+            tree.add(a[1], a[2], a[0]);
             break;
-        }
-        case 5: {
-            int x, l, r;
-            in >> x >> l >> r;
-            tree.add(l, r, x);
+        case 6:
+            tree.nextPermutation(a[0], a[1]);
             break;
-        }
-        case 6: {
-            int l, r;
-            in >> l >> r;
-            tree.nextPermutation(l, r);
+        case 7:
+            tree.prevPermutation(a[0], a[1]);
             break;
-        }
-        case 7: {
-            int l, r;
-            in >> l >> r;
-            tree.prevPermutation(l, r);
+        case 8:
+            tree.reverse(a[0], a[1]);
             break;
-        }
+        case 9:
+            tree.swapRanges(a[0], a[1], a[2], a[3]);
+            break;
+        case 10:
+            tree.moveRange(a[0], a[1], a[2]);
+            break;
+        case 11:
+            tree.rotate(a[0], a[1], a[2]);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+void applyQuery(SplayTree &tree, const ParsedQuery &query, std::ostream &out) {
+    long long result = executeQuery(tree, query);
+    if (query.type == 1) {
+        out << result << "\n";
+    }
+}
+
+// Checks that the positions of the query are inside a sequence of the given size,
+// for queries coming from sources that cannot be trusted to be well-formed.
+bool isValidQuery(const ParsedQuery &query, long long size) {
+    const long long *a = query.args;
+    auto isRange = [size](long long l, long long r) {
+        return 0 <= l && l <= r && r < size;
+    };
+    switch (query.type) {
+        case 1:
+        case 6:
+        case 7:
+        case 8:
+            return isRange(a[0], a[1]);
+        case 2:
+            return 0 <= a[1] && a[1] <= size;
+        case 3:
+            return 0 <= a[0] && a[0] < size;
+        case 4:
+        case 5:
+            return isRange(a[1], a[2]);
+        case 9:
+            return isRange(a[0], a[1]) && isRange(a[2], a[3]) && (a[1] < a[2] || a[3] < a[0]);
+        case 10:
+            return isRange(a[0], a[1]) && 0 <= a[2] && a[2] <= size - (a[1] - a[0] + 1);
+        case 11:
+            return isRange(a[0], a[2]) && a[0] <= a[1] && a[1] <= a[2];
         default:
+            return false;
+    }
+}
+
+void processQuery(SplayTree &tree, std::istream &in, std::ostream &out) {
+    applyQuery(tree, readQuery(in), out);
+}
+
+bool isMutatingQuery(int type) {
+    return type >= 2 && type <= 11;
+}
+
+// Binary encoding of a query: the type byte followed by its arguments as zigzag varints.
+void encodeQuery(const ParsedQuery &query, std::vector<char> &out) {
+    out.push_back(static_cast<char>(query.type));
+    for (int i = 0; i < getArgumentsCount(query.type); i++) {
+        uint64_t value = (static_cast<uint64_t>(query.args[i]) << 1) ^ static_cast<uint64_t>(query.args[i] >> 63);
+        while (value >= 0x80) {
+            out.push_back(static_cast<char>(value | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+}
+
+// the longest encoding: the type byte and four 10-byte varints
+const size_t MAX_ENCODED_QUERY_SIZE = 1 + 4 * 10;
+
+enum DecodeResult {
+    DECODE_OK, DECODE_INCOMPLETE, DECODE_INVALID
+};
+
+// Decodes one query starting at data and advances data past it (only on DECODE_OK).
+// DECODE_INCOMPLETE means [data, end) is a prefix of a valid query, DECODE_INVALID that it cannot become one.
+DecodeResult decodeQuery(const char *&data, const char *end, ParsedQuery &query) {
+    const char *position = data;
+    if (position == end) {
+        return DECODE_INCOMPLETE;
+    }
+    query.type = static_cast<unsigned char>(*position++);
+    if (getArgumentsCount(query.type) == 0) {
+        return DECODE_INVALID;
+    }
+    for (int i = 0; i < getArgumentsCount(query.type); i++) {
+        uint64_t value = 0;
+        for (int shift = 0;; shift += 7) {
+            if (shift > 63) {
+                return DECODE_INVALID;
+            }
+            if (position == end) {
+                return DECODE_INCOMPLETE;
+            }
+            auto byte = static_cast<unsigned char>(*position++);
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (byte < 0x80) {
+                break;
+            }
+        }
+        query.args[i] = static_cast<long long>(value >> 1) ^ -static_cast<long long>(value & 1);
+    }
+    data = position;
+    return DECODE_OK;
+}
+
+// The directory holding path, which has to be synced for a rename or a new file in it to be durable.
+std::string parentDirectory(const std::string &path) {
+    size_t slash = path.find_last_of('/');
+    if (slash == std::string::npos) {
+        return ".";
+    }
+    return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+bool syncFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool synced = fsync(fd) == 0;
+    close(fd);
+    return synced;
+}
+
+// Append-only log of mutating queries for crash recovery. Records are buffered in memory
+// and written with one write + fdatasync (group commit) once syncEvery records are pending
+// or syncInterval has passed since the last sync. The interval is only checked on append,
+// so callers that go idle should call sync() themselves.
+// The file starts with a header holding its generation, which every checkpoint advances; a snapshot
+// records the first generation it does not contain, so that recovery never replays a journal twice.
+class Journal {
+public:
+    Journal() = default;
+
+    Journal(const Journal &other) = delete;
+
+    Journal &operator=(const Journal &other) = delete;
+
+    ~Journal() {
+        close();
+    }
+
+    bool open(const std::string &path, size_t syncEvery = 1024,
+              std::chrono::milliseconds syncInterval = std::chrono::milliseconds(10)) {
+        close();
+        records_ = 0;
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        syncEvery_ = std::max<size_t>(syncEvery, 1);
+        syncInterval_ = syncInterval;
+        lastSyncTime_ = std::chrono::steady_clock::now();
+        if (fd_ < 0) {
+            return false;
+        }
+
+        Header header;
+        ssize_t res = pread(fd_, &header, sizeof(header), 0);
+        bool valid;
+        if (res >= 0 && static_cast<size_t>(res) < sizeof(header)) {
+            // new, or emptied by a checkpoint that did not get to write the header
+            generation_ = 0;
+            valid = ftruncate(fd_, 0) == 0 && writeHeader_();
+        } else {
+            generation_ = header.generation;
+            valid = res > 0 && std::memcmp(header.magic, Header().magic, sizeof(header.magic)) == 0;
+        }
+        if (!valid) {
+            ::close(fd_);
+            fd_ = -1;
+        }
+        return valid;
+    }
+
+    uint64_t generation() const {
+        return generation_;
+    }
+
+    // records appended since the journal was opened or truncated
+    size_t records() const {
+        return records_;
+    }
+
+    bool isOpen() const {
+        return fd_ >= 0;
+    }
+
+    bool append(const ParsedQuery &query) {
+        encodeQuery(query, buffer_);
+        pendingRecords_++;
+        records_++;
+        if (pendingRecords_ >= syncEvery_ || std::chrono::steady_clock::now() - lastSyncTime_ >= syncInterval_) {
+            return sync();
+        }
+        return true;
+    }
+
+    bool sync() {
+        lastSyncTime_ = std::chrono::steady_clock::now();
+        if (pendingRecords_ == 0) {
+            return true;
+        }
+        size_t written = 0;
+        while (written < buffer_.size()) {
+            ssize_t res = write(fd_, buffer_.data() + written, buffer_.size() - written);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res < 0) {
+                // what reached the file must not be written again by the next sync
+                buffer_.erase(buffer_.begin(), buffer_.begin() + written);
+                return false;
+            }
+            written += res;
+        }
+        buffer_.clear();
+        pendingRecords_ = 0;
+        return fdatasync(fd_) == 0;
+    }
+
+    // Drops every record and starts the next generation, e.g. after the state they lead to
+    // has been saved as a snapshot covering generations up to the current one.
+    bool truncate() {
+        buffer_.clear();
+        pendingRecords_ = 0;
+        records_ = 0;
+        generation_++;
+        return ftruncate(fd_, 0) == 0 && writeHeader_() && fdatasync(fd_) == 0;
+    }
+
+    void close() {
+        if (fd_ < 0) {
             return;
+        }
+        sync();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    // Applies the records of the journal at path to the tree, unless the journal is of a generation
+    // before firstGeneration (already contained in the snapshot the tree was loaded from). A torn record
+    // at the end, left by a crash in the middle of a write, ends the replay. Returns the number of applied records.
+    static size_t replay(const std::string &path, SplayTree &tree, uint64_t firstGeneration = 0) {
+        std::ifstream in(path, std::ios::binary);
+        std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        Header header;
+        if (data.size() < sizeof(header)) {
+            return 0;
+        }
+        std::memcpy(&header, data.data(), sizeof(header));
+        if (std::memcmp(header.magic, Header().magic, sizeof(header.magic)) != 0 ||
+            header.generation < firstGeneration) {
+            return 0;
+        }
+
+        size_t count = 0;
+        const char *position = data.data() + sizeof(header);
+        ParsedQuery query;
+        std::ostringstream ignoredOutput;
+        while (decodeQuery(position, data.data() + data.size(), query) == DECODE_OK && isMutatingQuery(query.type)) {
+            applyQuery(tree, query, ignoredOutput);
+            count++;
+        }
+        return count;
+    }
+
+private:
+    struct Header {
+        char magic[4] = {'S', 'P', 'L', 'J'};
+        uint32_t padding = 0;
+        uint64_t generation = 0;
+    };
+
+    int fd_ = -1;
+    uint64_t generation_ = 0;
+    std::vector<char> buffer_;
+    size_t pendingRecords_ = 0;
+    size_t records_ = 0;
+    size_t syncEvery_ = 1;
+    std::chrono::milliseconds syncInterval_{0};
+    std::chrono::steady_clock::time_point lastSyncTime_;
+
+    // Only called on an empty file, which O_APPEND then writes from the start.
+    bool writeHeader_() {
+        Header header;
+        header.generation = generation_;
+        const char *data = reinterpret_cast<const char *>(&header);
+        size_t written = 0;
+        while (written < sizeof(header)) {
+            ssize_t res = write(fd_, data + written, sizeof(header) - written);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res < 0) {
+                return false;
+            }
+            written += res;
+        }
+        return true;
+    }
+};
+
+// Writes a snapshot of the tree durably and empties the journal, whose records it now contains.
+// Until the journal moves to the next generation, recovery skips it as contained in the snapshot.
+bool checkpoint(SplayTree &tree, Journal &journal, const std::string &snapshotPath) {
+    std::string temporaryPath = snapshotPath + ".tmp";
+    if (!journal.sync() || !tree.save(temporaryPath, true, journal.generation() + 1) || !syncFile(temporaryPath) ||
+        std::rename(temporaryPath.c_str(), snapshotPath.c_str()) != 0 || !syncFile(parentDirectory(snapshotPath))) {
+        return false;
     }
+    return journal.truncate();
 }
 
-void solveProblem(std::istream &in, std::ostream &out) {
+// Restores the state saved by checkpoint and the journal written after it.
+bool recover(SplayTree &tree, const std::string &snapshotPath, const std::string &journalPath) {
+    uint64_t journalGeneration = 0;
+    if (!tree.load(snapshotPath, &journalGeneration)) {
+        return false;
+    }
+    Journal::replay(journalPath, tree, journalGeneration);
+    return true;
+}
+
+// Appends a query to the batch, folding it into the queries at the back when the result is the same:
+// adds on the same range are summed up, and adds/assigns inside the range of a new assign are dropped.
+void enqueueQuery(std::vector<ParsedQuery> &batch, const ParsedQuery &query) {
+    auto sameRange = [&query](const ParsedQuery &other) {
+        return other.args[1] == query.args[1] && other.args[2] == query.args[2];
+    };
+
+    if (query.type == 5 && !batch.empty() && (batch.back().type == 4 || batch.back().type == 5) &&
+        sameRange(batch.back())) {
+        long long value;
+        if (!__builtin_add_overflow(batch.back().args[0], query.args[0], &value)) {
+            batch.back().args[0] = value;
+            return;
+        }
+    }
+
+    if (query.type == 4) {
+        while (!batch.empty() && (batch.back().type == 4 || batch.back().type == 5) &&
+               batch.back().args[1] >= query.args[1] && batch.back().args[2] <= query.args[2]) {
+            batch.pop_back();
+        }
+    }
+
+    batch.push_back(query);
+}
+
+// Executes the batch in order. A long enough run of sum queries is answered
+// from prefix sums over a snapshot of the sequence instead of splitting the tree per query.
+void executeBatch(SplayTree &tree, const std::vector<ParsedQuery> &batch, std::ostream &out) {
+    // a snapshot costs O(n), a single sum query roughly O(log n) with a much larger constant
+    const size_t snapshotElementsPerQuery = 64;
+
+    std::vector<long long> prefixSums;
+    for (size_t i = 0; i < batch.size();) {
+        size_t runEnd = i;
+        while (runEnd < batch.size() && batch[runEnd].type == 1) {
+            runEnd++;
+        }
+
+        if (runEnd - i < 2 || (runEnd - i) * snapshotElementsPerQuery < tree.size()) {
+            // the run is too short to pay for a snapshot, so its remainder would be too
+            runEnd = std::max(runEnd, i + 1);
+            for (; i < runEnd; i++) {
+                applyQuery(tree, batch[i], out);
+            }
+            continue;
+        }
+
+        auto values = tree.toVector();
+        prefixSums.assign(values.size() + 1, 0);
+        std::partial_sum(values.begin(), values.end(), prefixSums.begin() + 1);
+
+        for (; i < runEnd; i++) {
+            if (!isValidQuery(batch[i], values.size())) {
+                // answered by the tree, so that bad input gives what it gives without batching
+                applyQuery(tree, batch[i], out);
+                continue;
+            }
+            out << prefixSums[batch[i].args[1] + 1] - prefixSums[batch[i].args[0]] << "\n";
+        }
+    }
+}
+
+struct SolveOptions {
+    // 0 executes every query as soon as it is read
+    size_t batchSize = 0;
+    // with a journal path every mutating query is journaled before it is executed
+    std::string journalPath;
+    std::string snapshotPath;
+    // start from snapshotPath + journalPath instead of the sequence in the input
+    bool recover = false;
+    // serve queries over this Unix socket instead of reading them from the input
+    std::string socketPath;
+    // checkpoint once the journal holds this many records, so that recovery replays a bounded tail; 0 never does
+    size_t checkpointEvery = 1 << 20;
+};
+
+// Called after the journaled queries have been executed. Returns false if a due checkpoint failed.
+bool checkpointIfDue(SplayTree &tree, Journal &journal, const SolveOptions &options) {
+    if (!journal.isOpen() || options.checkpointEvery == 0 || journal.records() < options.checkpointEvery) {
+        return true;
+    }
+    if (!checkpoint(tree, journal, options.snapshotPath)) {
+        std::cerr << "cannot checkpoint to " << options.snapshotPath << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Reads the initial sequence (or recovers it) and opens the journal if the options ask for one.
+bool prepareTree(SplayTree &tree, Journal &journal, std::istream &in, const SolveOptions &options) {
+    if (options.recover) {
+        if (!recover(tree, options.snapshotPath, options.journalPath)) {
+            std::cerr << "cannot recover from " << options.snapshotPath << "\n";
+            return false;
+        }
+    } else {
+        readTree(tree, in);
+    }
+    if (!options.journalPath.empty()) {
+        if (!journal.open(options.journalPath) || !checkpoint(tree, journal, options.snapshotPath)) {
+            std::cerr << "cannot open journal " << options.journalPath << "\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+void solveProblem(std::istream &in, std::ostream &out, const SolveOptions &options = {}) {
     SplayTree tree;
-    readTree(tree, in);
+    Journal journal;
+    if (!prepareTree(tree, journal, in, options)) {
+        return;
+    }
 
-    int countOfQueries = 0;
+    long long countOfQueries = 0;
     in >> countOfQueries;
 
-    for (int i = 0; i < countOfQueries; i++) {
-        processQuery(tree, in, out);
+    if (options.batchSize == 0) {
+        for (long long i = 0; i < countOfQueries; i++) {
+            ParsedQuery query = readQuery(in);
+            if (journal.isOpen() && isMutatingQuery(query.type) && !journal.append(query)) {
+                std::cerr << "cannot write journal " << options.journalPath << "\n";
+                return;
+            }
+            applyQuery(tree, query, out);
+            if (!checkpointIfDue(tree, journal, options)) {
+                return;
+            }
+        }
+    } else {
+        std::vector<ParsedQuery> batch;
+        for (long long i = 0; i < countOfQueries; i += options.batchSize) {
+            batch.clear();
+            for (long long j = i; j < countOfQueries && j < i + static_cast<long long>(options.batchSize); j++) {
+                enqueueQuery(batch, readQuery(in));
+            }
+            if (journal.isOpen()) {
+                for (const ParsedQuery &query : batch) {
+                    if (isMutatingQuery(query.type) && !journal.append(query)) {
+                        std::cerr << "cannot write journal " << options.journalPath << "\n";
+                        return;
+                    }
+                }
+            }
+            executeBatch(tree, batch, out);
+            if (!checkpointIfDue(tree, journal, options)) {
+                return;
+            }
+        }
+    }
+    if (journal.isOpen() && !journal.sync()) {
+        std::cerr << "cannot write journal " << options.journalPath << "\n";
+        return;
     }
+    journal.close();
 
     printTree(tree, out);
 }
 
-int main() {
+volatile std::sig_atomic_t stopServer = 0;
+
+// Serves queries on a Unix domain socket from a single thread, which is also the only one touching the tree.
+// Requests are queries in the journal encoding (see encodeQuery) and may be pipelined. Every request
+// is answered in order with a status byte (RESPONSE_OK, RESPONSE_INVALID or RESPONSE_NOT_DURABLE)
+// and a native 64-bit result, the sum for type 1 and 0 otherwise. Each poll round collects the requests
+// of all connections into one batch, executes it, group-commits it to the journal and only then replies.
+class QueryServer {
+public:
+    static const char RESPONSE_OK = 0;
+    static const char RESPONSE_INVALID = 1;
+    // the query was executed but could not be journaled, after which the server stops
+    static const char RESPONSE_NOT_DURABLE = 2;
+    static const size_t RESPONSE_SIZE = 1 + sizeof(long long);
+
+    QueryServer(SplayTree &tree, Journal &journal, const SolveOptions &options) : tree_(tree),
+                                                                                  journal_(journal),
+                                                                                  options_(options) {}
+
+    QueryServer(const QueryServer &other) = delete;
+
+    QueryServer &operator=(const QueryServer &other) = delete;
+
+    ~QueryServer() {
+        for (Connection &connection : connections_) {
+            close(connection.fd);
+        }
+        if (listenFd_ >= 0) {
+            close(listenFd_);
+            unlink(socketPath_.c_str());
+        }
+    }
+
+    bool listen(const std::string &socketPath) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+        std::strcpy(address.sun_path, socketPath.c_str());
+        unlink(socketPath.c_str());
+
+        listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (listenFd_ < 0 || bind(listenFd_, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            ::listen(listenFd_, SOMAXCONN) != 0) {
+            return false;
+        }
+        socketPath_ = socketPath;
+        return true;
+    }
+
+    // Runs the event loop until stopServer is set. Returns false if it stopped because the journal
+    // or a checkpoint failed (which it reports).
+    bool run() {
+        std::vector<pollfd> pollFds;
+        while (!stopServer) {
+            pollFds.clear();
+            pollFds.push_back({listenFd_, POLLIN, 0});
+            for (const Connection &connection : connections_) {
+                short events = connection.output.size() < MAX_PENDING_OUTPUT ? POLLIN : 0;
+                if (connection.outputOffset < connection.output.size()) {
+                    events |= POLLOUT;
+                }
+                pollFds.push_back({connection.fd, events, 0});
+            }
+
+            if (poll(pollFds.data(), pollFds.size(), POLL_TIMEOUT_MS) < 0) {
+                continue;
+            }
+
+            for (size_t i = 0; i < connections_.size(); i++) {
+                short events = pollFds[i + 1].revents;
+                if (events & (POLLIN | POLLHUP | POLLERR)) {
+                    readRequests_(connections_[i]);
+                }
+            }
+            bool journaled = executeBatch_();
+            for (Connection &connection : connections_) {
+                writeResponses_(connection);
+            }
+            removeClosedConnections_();
+            if (!journaled) {
+                // the tree is ahead of what recovery would restore
+                std::cerr << "cannot write journal " << options_.journalPath << "\n";
+                return false;
+            }
+            if (!checkpointIfDue(tree_, journal_, options_)) {
+                return false;
+            }
+
+            if (pollFds[0].revents & POLLIN) {
+                acceptConnections_();
+            }
+        }
+        return true;
+    }
+
+private:
+    static const size_t READ_CHUNK_SIZE = 1 << 16;
+    static const size_t MAX_PENDING_OUTPUT = 1 << 20;
+    static const int POLL_TIMEOUT_MS = 100;
+
+    struct Connection {
+        int fd;
+        std::vector<char> input;
+        std::vector<char> output;
+        size_t outputOffset = 0;
+        bool closed = false;
+    };
+
+    struct PendingRequest {
+        size_t connection;
+        ParsedQuery query;
+    };
+
+    SplayTree &tree_;
+    Journal &journal_;
+    const SolveOptions &options_;
+    int listenFd_ = -1;
+    std::string socketPath_;
+    std::vector<Connection> connections_;
+    std::vector<PendingRequest> batch_;
+
+    void acceptConnections_() {
+        while (true) {
+            int fd = accept4(listenFd_, nullptr, nullptr, SOCK_NONBLOCK);
+            if (fd < 0) {
+                return;
+            }
+            connections_.push_back({fd, {}, {}, 0, false});
+        }
+    }
+
+    void readRequests_(Connection &connection) {
+        size_t connectionIndex = &connection - connections_.data();
+        char chunk[READ_CHUNK_SIZE];
+        ssize_t res = read(connection.fd, chunk, sizeof(chunk));
+        if (res == 0 || (res < 0 && errno != EAGAIN && errno != EINTR)) {
+            connection.closed = true;
+            return;
+        }
+        if (res < 0) {
+            return;
+        }
+        connection.input.insert(connection.input.end(), chunk, chunk + res);
+
+        const char *position = connection.input.data();
+        const char *end = position + connection.input.size();
+        ParsedQuery query;
+        DecodeResult result;
+        while ((result = decodeQuery(position, end, query)) == DECODE_OK) {
+            batch_.push_back({connectionIndex, query});
+        }
+        connection.input.erase(connection.input.begin(), connection.input.begin() + (position - connection.input.data()));
+        if (result == DECODE_INVALID || connection.input.size() >= MAX_ENCODED_QUERY_SIZE) {
+            // the rest of the stream cannot be parsed
+            connection.closed = true;
+        }
+    }
+
+    // Returns false if the journal could not be written, after failing the mutating replies of the batch.
+    bool executeBatch_() {
+        if (batch_.empty()) {
+            return true;
+        }
+        bool journaled = true;
+        // (connection, offset of the status byte) of the replies that need the journal sync
+        std::vector<std::pair<size_t, size_t>> mutations;
+        for (const PendingRequest &request : batch_) {
+            char status = RESPONSE_INVALID;
+            long long result = 0;
+            std::vector<char> &output = connections_[request.connection].output;
+            if (isValidQuery(request.query, tree_.size())) {
+                if (journal_.isOpen() && isMutatingQuery(request.query.type)) {
+                    journaled = journal_.append(request.query) && journaled;
+                    mutations.emplace_back(request.connection, output.size());
+                }
+                result = executeQuery(tree_, request.query);
+                status = RESPONSE_OK;
+            }
+
+            output.push_back(status);
+            output.insert(output.end(), reinterpret_cast<const char *>(&result),
+                          reinterpret_cast<const char *>(&result) + sizeof(result));
+        }
+        batch_.clear();
+        if (journal_.isOpen()) {
+            journaled = journal_.sync() && journaled;
+        }
+        if (!journaled) {
+            for (const auto &mutation : mutations) {
+                connections_[mutation.first].output[mutation.second] = RESPONSE_NOT_DURABLE;
+            }
+        }
+        return journaled;
+    }
+
+    static void writeResponses_(Connection &connection) {
+        while (!connection.closed && connection.outputOffset < connection.output.size()) {
+            ssize_t res = send(connection.fd, connection.output.data() + connection.outputOffset,
+                               connection.output.size() - connection.outputOffset, MSG_NOSIGNAL);
+            if (res < 0) {
+                if (errno != EAGAIN && errno != EINTR) {
+                    connection.closed = true;
+                }
+                return;
+            }
+            connection.outputOffset += res;
+        }
+        connection.output.clear();
+        connection.outputOffset = 0;
+    }
+
+    void removeClosedConnections_() {
+        auto it = std::remove_if(connections_.begin(), connections_.end(), [](const Connection &connection) {
+            if (connection.closed) {
+                close(connection.fd);
+            }
+            return connection.closed;
+        });
+        connections_.erase(it, connections_.end());
+    }
+};
+
+void serve(std::istream &in, const SolveOptions &options) {
+    SplayTree tree;
+    Journal journal;
+    if (!prepareTree(tree, journal, in, options)) {
+        return;
+    }
+
+    QueryServer server(tree, journal, options);
+    if (!server.listen(options.socketPath)) {
+        std::cerr << "cannot listen on " << options.socketPath << "\n";
+        return;
+    }
+
+    auto stop = [](int) {
+        stopServer = 1;
+    };
+    std::signal(SIGINT, stop);
+    std::signal(SIGTERM, stop);
+    server.run();
+}
+
+// Load generator for QueryServer: each client keeps pipelineDepth requests in flight,
+// mixing sum queries with adds and assigns on random ranges of a sequence of the given size.
+void runLoadGenerator(const std::string &socketPath, int clients, long long requestsPerClient,
+                      int pipelineDepth, long long sequenceSize, std::ostream &out) {
+    std::atomic<long long> completed(0);
+    std::atomic<long long> failed(0);
+
+    auto client = [&](int seed) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            failed += requestsPerClient;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+
+        std::mt19937_64 random(seed);
+        std::vector<char> requests;
+        std::vector<char> responses;
+        for (long long sent = 0; sent < requestsPerClient;) {
+            long long count = std::min<long long>(pipelineDepth, requestsPerClient - sent);
+            requests.clear();
+            for (long long i = 0; i < count; i++) {
+                ParsedQuery query;
+                long long l = random() % sequenceSize;
+                long long r = random() % sequenceSize;
+                if (l > r) {
+                    std::swap(l, r);
+                }
+                int kind = random() % 10;
+                if (kind < 8) {
+                    query.type = 1;
+                    query.args[0] = l;
+                    query.args[1] = r;
+                } else {
+                    query.type = kind == 8 ? 5 : 4;
+                    query.args[0] = static_cast<long long>(random() % 201) - 100;
+                    query.args[1] = l;
+                    query.args[2] = r;
+                }
+                encodeQuery(query, requests);
+            }
+
+            bool ok = send(fd, requests.data(), requests.size(), MSG_NOSIGNAL) ==
+                      static_cast<ssize_t>(requests.size());
+            responses.resize(count * QueryServer::RESPONSE_SIZE);
+            size_t received = 0;
+            while (ok && received < responses.size()) {
+                ssize_t res = read(fd, responses.data() + received, responses.size() - received);
+                ok = res > 0;
+                received += ok ? res : 0;
+            }
+            if (!ok) {
+                failed += requestsPerClient - sent;
+                break;
+            }
+            for (long long i = 0; i < count; i++) {
+                if (responses[i * QueryServer::RESPONSE_SIZE] != QueryServer::RESPONSE_OK) {
+                    failed++;
+                }
+            }
+            completed += count;
+            sent += count;
+        }
+        close(fd);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < clients; i++) {
+        threads.emplace_back(client, i + 1);
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    out << completed << " requests (" << failed << " failed) from " << clients << " clients in "
+        << seconds << " s: " << static_cast<long long>(completed / seconds) << " ops/s\n";
+}
+
+// Times random operations on a sequence of the given size, kept in RAM or, if nodeFile is set,
+// in that node file (which is recreated). Run it under a memory limit to compare the two modes:
+// the sequence is built by appending, so that it never exists as a whole outside its pool.
+bool runOutOfCoreBenchmark(long long sequenceSize, long long operations, const std::string &nodeFile,
+                           std::ostream &out) {
+    if (sequenceSize <= 0 || operations < 0) {
+        return false;
+    }
+    SplayTree tree;
+    if (!nodeFile.empty()) {
+        unlink(nodeFile.c_str());
+        if (!tree.mapFile(nodeFile)) {
+            return false;
+        }
+    }
+    std::mt19937_64 random(1);
+    auto start = std::chrono::steady_clock::now();
+    for (long long i = 0; i < sequenceSize; i++) {
+        tree.insert(i, static_cast<long long>(random() % 1000));
+    }
+    double buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    start = std::chrono::steady_clock::now();
+    long long checksum = 0;
+    for (long long i = 0; i < operations; i++) {
+        long long l = random() % sequenceSize;
+        long long r = random() % sequenceSize;
+        if (l > r) {
+            std::swap(l, r);
+        }
+        switch (i % 4) {
+            case 0:
+                checksum += tree.getSum(l, r);
+                break;
+            case 1:
+                tree.add(l, r, 1);
+                break;
+            case 2:
+                tree.reverse(l, r);
+                break;
+            default:
+                tree.insert(l, 0);
+                tree.remove(r);
+                break;
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    out << (nodeFile.empty() ? "in RAM" : "mapped") << ": built " << sequenceSize << " elements in "
+        << buildSeconds << " s, " << operations << " operations in " << seconds << " s: "
+        << static_cast<long long>(operations / seconds) << " ops/s, pool " << tree.memoryUsage()
+        << " bytes, peak RSS " << usage.ru_maxrss << " KiB (checksum " << checksum << ")\n";
+    return true;
+}
+
+// Usage:
+//   SplayTree [--batch N] [--journal PATH [--snapshot PATH] [--recover] [--checkpoint-every N]] < input
+//   SplayTree --serve SOCKET [--journal PATH ...] < initial sequence
+//   SplayTree --loadgen SOCKET CLIENTS REQUESTS_PER_CLIENT PIPELINE_DEPTH SEQUENCE_SIZE
+//   SplayTree --bench-ooc SEQUENCE_SIZE OPERATIONS [NODE_FILE]
+int main(int argc, char **argv) {
     std::ios_base::sync_with_stdio(false);
     std::cin.tie(nullptr);
     std::cout.tie(nullptr);
 
-    solveProblem(std::cin, std::cout);
+    SolveOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--recover") {
+            options.recover = true;
+        } else if (i + 1 < argc && arg == "--batch") {
+            options.batchSize = std::stoul(argv[++i]);
+        } else if (i + 1 < argc && arg == "--journal") {
+            options.journalPath = argv[++i];
+        } else if (i + 1 < argc && arg == "--checkpoint-every") {
+            options.checkpointEvery = std::stoul(argv[++i]);
+        } else if (i + 1 < argc && arg == "--snapshot") {
+            options.snapshotPath = argv[++i];
+        } else if (i + 1 < argc && arg == "--serve") {
+            options.socketPath = argv[++i];
+        } else if (i + 5 < argc && arg == "--loadgen") {
+            runLoadGenerator(argv[i + 1], std::stoi(argv[i + 2]), std::stoll(argv[i + 3]), std::stoi(argv[i + 4]),
+                             std::stoll(argv[i + 5]), std::cout);
+            return 0;
+        } else if (i + 2 < argc && arg == "--bench-ooc") {
+            std::string nodeFile = i + 3 < argc ? argv[i + 3] : "";
+            if (!runOutOfCoreBenchmark(std::stoll(argv[i + 1]), std::stoll(argv[i + 2]), nodeFile, std::cout)) {
+                std::cerr << "cannot run the benchmark" << (nodeFile.empty() ? "" : " on " + nodeFile) << "\n";
+                return 1;
+            }
+            return 0;
+        }
+    }
+    if (!options.journalPath.empty() && options.snapshotPath.empty()) {
+        options.snapshotPath = options.journalPath + ".snapshot";
+    }
+
+    if (!options.socketPath.empty()) {
+        serve(std::cin, options);
+    } else {
+        solveProblem(std::cin, std::cout, options);
+    }
 }